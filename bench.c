@@ -0,0 +1,558 @@
+/*
+ * In-process benchmark of the driver. It calls the callbacks of sfs_oper
+ * directly, so it needs no FUSE mount (and no privileges): sfs.c is included
+ * here to reach them, with its main renamed away. Every run generates a fresh
+ * empty image and drives reproducible workloads against it, reporting per
+ * workload the operations per second, the latency percentiles of single
+ * calls, and the reads and writes of the image (the counters of sfs.c's
+ * statistics, which below the cache are the diskio calls).
+ *
+ * usage: ./bench [options] [workload...]
+ * With --kernels it times the scanning kernels of sfs.c instead.
+ * All options of sfs (e.g. --cache=N, --mmap) apply; see --help.
+ */
+#define main sfs_main
+#include "sfs.c"
+#undef main
+
+static const char default_bench_img[] = "bench.img";
+
+/* Options of the benchmark itself, next to those of sfs */
+struct bench_options {
+    unsigned seed;
+    unsigned scale;
+    int list;
+    int kernels;
+} bench_options;
+
+#define BOPTION(t, p) \
+    { t, offsetof(struct bench_options, p), 1 }
+static const struct fuse_opt bench_option_spec[] = {
+    BOPTION("--seed=%u",  seed),
+    BOPTION("--scale=%u", scale),
+    BOPTION("--list",     list),
+    BOPTION("--kernels",  kernels),
+    FUSE_OPT_END
+};
+
+/*
+ * A run of a workload: the latency of each timed call, and the counters of
+ * sfs.c when it started.
+ */
+struct run {
+    uint64_t *ns;
+    size_t n, cap;
+    uint64_t start;
+    uint64_t io[STATS_NIO];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+/*
+Function that sums the I/O counters of all threads (the write-back and
+defragmentation threads do I/O too) into io.
+*/
+static void io_totals(uint64_t io[STATS_NIO]) {
+    memset(io, 0, STATS_NIO * sizeof(uint64_t));
+    pthread_mutex_lock(&stats_lock);
+    for (struct stats_block *b = stats_blocks; b != NULL; b = b->next) {
+        for (size_t i = 0; i < STATS_NIO; i++) {
+            io[i] += __atomic_load_n(&b->io[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void run_begin(struct run *r) {
+    r->n = 0;
+    io_totals(r->io);
+    r->start = now_ns();
+}
+
+static void run_sample(struct run *r, uint64_t t0) {
+    uint64_t t = now_ns() - t0;
+    if (r->n == r->cap) {
+        r->cap = r->cap ? 2 * r->cap : 4096;
+        r->ns = (uint64_t *) realloc(r->ns, r->cap * sizeof(uint64_t));
+    }
+    r->ns[r->n++] = t;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct_us(const struct run *r, double q) {
+    size_t i = (size_t) (q * (r->n - 1) + 0.5);
+    return r->ns[i] / 1000.0;
+}
+
+static void run_end(struct run *r, const char *name) {
+    uint64_t elapsed = now_ns() - r->start;
+    uint64_t io[STATS_NIO];
+    io_totals(io);
+    for (size_t i = 0; i < STATS_NIO; i++) {io[i] -= r->io[i];}
+
+    qsort(r->ns, r->n, sizeof(uint64_t), cmp_u64);
+    printf("%-9s %8zu %10.0f %8.1f %8.1f %8.1f %9.1f %9llu %9llu %9llu %9llu\n",
+           name, r->n, r->n / (elapsed / 1e9), pct_us(r, 0.5), pct_us(r, 0.9),
+           pct_us(r, 0.99), r->ns[r->n - 1] / 1000.0,
+           (unsigned long long) io[STATS_READS],
+           (unsigned long long) (io[STATS_READ_BYTES] / 1024),
+           (unsigned long long) io[STATS_WRITES],
+           (unsigned long long) (io[STATS_WRITE_BYTES] / 1024));
+}
+
+/*
+Function that stops the benchmark if a callback failed: numbers of failing
+calls are no use.
+*/
+static void check(int r, int want, const char *what, const char *path) {
+    if (r == want) {return;}
+    fprintf(stderr, "bench: %s %s returned %d, expected %d\n", what, path, r, want);
+    exit(1);
+}
+
+/*
+Function that writes an empty image of the full size to path.
+*/
+static void make_image(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    static blockidx_t table[SFS_BLOCKTBL_NENTRIES];
+    static char rootdir[SFS_ROOTDIR_SIZE];
+    for (size_t i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) {table[i] = SFS_BLOCKIDX_EMPTY;}
+    if (pwrite(fd, sfs_magic, SFS_MAGIC_SIZE, 0) != SFS_MAGIC_SIZE
+        || pwrite(fd, rootdir, sizeof(rootdir), SFS_ROOTDIR_OFF) != (ssize_t) sizeof(rootdir)
+        || pwrite(fd, table, sizeof(table), SFS_BLOCKTBL_OFF) != (ssize_t) sizeof(table)
+        || ftruncate(fd, SFS_DATA_OFF + (off_t) SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE) != 0) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+}
+
+static void make_file(const char *path, size_t size) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDWR;
+    check(sfs_oper.create(path, 0644, &fi), 0, "create", path);
+    static char buf[65536];
+    for (size_t off = 0; off < size; off += sizeof(buf)) {
+        for (size_t i = 0; i < sizeof(buf); i++) {buf[i] = (char) (off + i * 7);}
+        size_t n = size - off < sizeof(buf) ? size - off : sizeof(buf);
+        check(sfs_oper.write(path, buf, n, off, &fi), n, "write", path);
+    }
+    sfs_oper.release(path, &fi);
+}
+
+/*
+ * The workloads. Each starts from and leaves behind an empty root directory.
+ */
+#define SEQ_SIZE (2u << 20)
+#define SEQ_CHUNK 65536u
+
+static void bench_seqread(struct run *r) {
+    make_file("/seq", SEQ_SIZE);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    check(sfs_oper.open("/seq", &fi), 0, "open", "/seq");
+    static char buf[SEQ_CHUNK];
+
+    run_begin(r);
+    for (unsigned pass = 0; pass < 8 * bench_options.scale; pass++) {
+        for (off_t off = 0; off < SEQ_SIZE; off += SEQ_CHUNK) {
+            uint64_t t0 = now_ns();
+            check(sfs_oper.read("/seq", buf, SEQ_CHUNK, off, &fi), SEQ_CHUNK, "read", "/seq");
+            run_sample(r, t0);
+        }
+    }
+    run_end(r, "seqread");
+
+    sfs_oper.release("/seq", &fi);
+    check(sfs_oper.unlink("/seq"), 0, "unlink", "/seq");
+}
+
+static void bench_randread(struct run *r) {
+    make_file("/rand", SEQ_SIZE);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    check(sfs_oper.open("/rand", &fi), 0, "open", "/rand");
+    unsigned seed = bench_options.seed;
+    char buf[4096];
+
+    run_begin(r);
+    for (unsigned i = 0; i < 20000 * bench_options.scale; i++) {
+        off_t off = (off_t) (rand_r(&seed) % (SEQ_SIZE / sizeof(buf))) * sizeof(buf);
+        uint64_t t0 = now_ns();
+        check(sfs_oper.read("/rand", buf, sizeof(buf), off, &fi), sizeof(buf), "read", "/rand");
+        run_sample(r, t0);
+    }
+    run_end(r, "randread");
+
+    sfs_oper.release("/rand", &fi);
+    check(sfs_oper.unlink("/rand"), 0, "unlink", "/rand");
+}
+
+/*
+Function that times creating and removing files in a directory: each sample
+is one create (with its release) or one unlink.
+*/
+static void bench_churn(struct run *r) {
+    check(sfs_oper.mkdir("/churn", 0755), 0, "mkdir", "/churn");
+    unsigned seed = bench_options.seed;
+    char path[64];
+    int live[SFS_DIR_NENTRIES] = {0};
+
+    run_begin(r);
+    for (unsigned i = 0; i < 4000 * bench_options.scale; i++) {
+        unsigned k = rand_r(&seed) % (SFS_DIR_NENTRIES / 2);
+        snprintf(path, sizeof(path), "/churn/file%u", k);
+        uint64_t t0 = now_ns();
+        if (live[k]) {
+            check(sfs_oper.unlink(path), 0, "unlink", path);
+        } else {
+            struct fuse_file_info fi;
+            memset(&fi, 0, sizeof(fi));
+            fi.flags = O_RDWR;
+            check(sfs_oper.create(path, 0644, &fi), 0, "create", path);
+            sfs_oper.release(path, &fi);
+        }
+        run_sample(r, t0);
+        live[k] = !live[k];
+    }
+    run_end(r, "churn");
+
+    for (unsigned k = 0; k < SFS_DIR_NENTRIES; k++) {
+        if (!live[k]) {continue;}
+        snprintf(path, sizeof(path), "/churn/file%u", k);
+        check(sfs_oper.unlink(path), 0, "unlink", path);
+    }
+    check(sfs_oper.rmdir("/churn"), 0, "rmdir", "/churn");
+}
+
+#define DEEP_LEVELS 8
+
+static void bench_getattr(struct run *r) {
+    char path[256] = "";
+    for (int i = 0; i < DEEP_LEVELS; i++) {
+        snprintf(path + strlen(path), sizeof(path) - strlen(path), "/level%d", i);
+        check(sfs_oper.mkdir(path, 0755), 0, "mkdir", path);
+    }
+    size_t dirlen = strlen(path);
+    strcat(path, "/file");
+    make_file(path, 1000);
+
+    struct stat st;
+    run_begin(r);
+    for (unsigned i = 0; i < 50000 * bench_options.scale; i++) {
+        uint64_t t0 = now_ns();
+        check(sfs_oper.getattr(path, &st), 0, "getattr", path);
+        run_sample(r, t0);
+    }
+    run_end(r, "getattr");
+
+    check(sfs_oper.unlink(path), 0, "unlink", path);
+    for (int i = DEEP_LEVELS; i > 0; i--) {
+        path[dirlen] = '\0';
+        check(sfs_oper.rmdir(path), 0, "rmdir", path);
+        dirlen = strrchr(path, '/') - path;
+    }
+}
+
+/*
+Function that times filling a directory to its last entry and emptying it
+again: each sample is one create or one unlink.
+*/
+static void bench_dirfill(struct run *r) {
+    check(sfs_oper.mkdir("/fill", 0755), 0, "mkdir", "/fill");
+    char path[64];
+
+    run_begin(r);
+    for (unsigned round = 0; round < 200 * bench_options.scale; round++) {
+        for (unsigned k = 0; k < SFS_DIR_NENTRIES; k++) {
+            snprintf(path, sizeof(path), "/fill/entry%u", k);
+            struct fuse_file_info fi;
+            memset(&fi, 0, sizeof(fi));
+            fi.flags = O_RDWR;
+            uint64_t t0 = now_ns();
+            check(sfs_oper.create(path, 0644, &fi), 0, "create", path);
+            sfs_oper.release(path, &fi);
+            run_sample(r, t0);
+        }
+        // the directory is full now
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        check(sfs_oper.create("/fill/extra", 0644, &fi), -ENOSPC, "create", "/fill/extra");
+        for (unsigned k = 0; k < SFS_DIR_NENTRIES; k++) {
+            snprintf(path, sizeof(path), "/fill/entry%u", k);
+            uint64_t t0 = now_ns();
+            check(sfs_oper.unlink(path), 0, "unlink", path);
+            run_sample(r, t0);
+        }
+    }
+    run_end(r, "dirfill");
+
+    check(sfs_oper.rmdir("/fill"), 0, "rmdir", "/fill");
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(struct run *r);
+} workloads[] = {
+    {"seqread",  bench_seqread},
+    {"randread", bench_randread},
+    {"churn",    bench_churn},
+    {"getattr",  bench_getattr},
+    {"dirfill",  bench_dirfill},
+};
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+/*
+ * The scanning kernels of sfs.c (see scan_init), timed one call at a time
+ * against their scalar versions on random directories and block tables, after
+ * checking that every version gives the same answers as the scalar one.
+ */
+struct kernel_set {
+    const char *name;
+    const char *feature;
+    scan_dir_fn dir;
+    scan_free_fn free;
+    scan_u16_fn u16;
+};
+
+static const struct kernel_set kernel_sets[] = {
+    {"scalar", NULL, scan_dir_scalar, scan_free_scalar, scan_u16_scalar},
+#ifdef SCAN_X86
+    {"sse2", "sse2", scan_dir_sse2, scan_free_sse2, scan_u16_sse2},
+    {"avx2", "avx2", scan_dir_avx2, scan_free_avx2, scan_u16_avx2},
+#endif
+};
+#define NKERNEL_SETS (sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+static int kernel_set_usable(const struct kernel_set *k) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (k->feature != NULL && strcmp(k->feature, "sse2") == 0) {return __builtin_cpu_supports("sse2");}
+    if (k->feature != NULL && strcmp(k->feature, "avx2") == 0) {return __builtin_cpu_supports("avx2");}
+#endif
+    return k->feature == NULL;
+}
+
+/*
+Function that fills the n entries at ents with random names that share long
+prefixes (so the compares have work to do), leaving about one in `holes`
+empty, and writes a name that is not among them to missing.
+*/
+static void random_dir(struct sfs_entry *ents, size_t n, unsigned holes, char *missing) {
+    static const char prefix[] = "a_rather_long_common_prefix_for_all_these_names_";
+    memset(ents, 0, n * sizeof(struct sfs_entry));
+    for (size_t i = 0; i < n; i++) {
+        if (rand() % holes == 0) {continue;}
+        size_t len = 1 + rand() % (SFS_FILENAME_MAX - 5);
+        size_t shared = rand() % (len + 1);
+        if (shared > sizeof(prefix) - 1) {shared = sizeof(prefix) - 1;}
+        memcpy(ents[i].filename, prefix, shared);
+        for (size_t j = shared; j < len; j++) {ents[i].filename[j] = 'a' + rand() % 26;}
+        ents[i].filename[len] = '\0';
+        ents[i].first_block = rand();
+        ents[i].size = rand();
+    }
+    // upper case never occurs in the names above
+    snprintf(missing, SFS_FILENAME_MAX, "%.*sX", (int) (rand() % 40), prefix);
+}
+
+static void random_table(blockidx_t *tbl, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        tbl[i] = rand() % 2 ? SFS_BLOCKIDX_EMPTY : (blockidx_t) (rand() % SFS_BLOCKIDX_END);
+    }
+}
+
+/*
+Function that checks every usable version of the kernels against the scalar
+one on `rounds` random inputs. Returns the number of disagreements.
+*/
+static size_t kernels_check(unsigned rounds) {
+    static blockidx_t tbl[SFS_BLOCKTBL_NENTRIES];
+    static uint64_t want_map[SFS_BLOCKTBL_NENTRIES / 64], map[SFS_BLOCKTBL_NENTRIES / 64];
+    struct sfs_entry ents[SFS_ROOTDIR_NENTRIES];
+    char missing[SFS_FILENAME_MAX];
+    const struct kernel_set *ref = &kernel_sets[0];
+    size_t bad = 0;
+
+    for (unsigned round = 0; round < rounds; round++) {
+        random_dir(ents, SFS_ROOTDIR_NENTRIES, 1 + round % 8, missing);
+        random_table(tbl, SFS_BLOCKTBL_NENTRIES);
+        size_t want_free = ref->free(tbl, SFS_BLOCKTBL_NENTRIES, want_map);
+        for (size_t k = 1; k < NKERNEL_SETS; k++) {
+            const struct kernel_set *ks = &kernel_sets[k];
+            if (!kernel_set_usable(ks)) {continue;}
+            for (size_t i = 0; i <= SFS_ROOTDIR_NENTRIES; i++) {
+                const char *name = i < SFS_ROOTDIR_NENTRIES ? ents[i].filename : missing;
+                if (name[0] == '\0') {continue;}
+                size_t len = strlen(name);
+                long want_slot, slot;
+                long want = ref->dir(ents, SFS_ROOTDIR_NENTRIES, name, len, &want_slot);
+                bad += ks->dir(ents, SFS_ROOTDIR_NENTRIES, name, len, &slot) != want;
+                bad += slot != want_slot;
+                bad += ks->dir(ents, SFS_ROOTDIR_NENTRIES, name, len, NULL) != want;
+            }
+            bad += ks->free(tbl, SFS_BLOCKTBL_NENTRIES, map) != want_free;
+            bad += memcmp(map, want_map, sizeof(map)) != 0;
+            for (size_t n = 0; n < 100; n += 7) {
+                blockidx_t v = tbl[rand() % SFS_BLOCKTBL_NENTRIES];
+                bad += ks->u16(tbl + n, SFS_BLOCKTBL_NENTRIES - n, v)
+                       != ref->u16(tbl + n, SFS_BLOCKTBL_NENTRIES - n, v);
+            }
+        }
+    }
+    return bad;
+}
+
+static volatile long kernel_sink;
+
+/*
+Function that returns the mean time in ns of one call of kernel `what` of k.
+*/
+static double kernel_time(const struct kernel_set *k, int what, unsigned calls,
+                          const struct sfs_entry *ents, const char *name, const blockidx_t *tbl)
+{
+    static uint64_t map[SFS_BLOCKTBL_NENTRIES / 64];
+    size_t len = strlen(name);
+    long slot;
+    uint64_t t0 = now_ns();
+    for (unsigned i = 0; i < calls; i++) {
+        switch (what) {
+        case 0: kernel_sink = k->dir(ents, SFS_ROOTDIR_NENTRIES, name, len, NULL); break;
+        case 1: kernel_sink = k->dir(ents, SFS_ROOTDIR_NENTRIES, name, len, &slot); break;
+        case 2: kernel_sink = k->free(tbl, SFS_BLOCKTBL_NENTRIES, map); break;
+        default: kernel_sink = k->u16(tbl, SFS_BLOCKTBL_NENTRIES, SFS_BLOCKIDX_END); break;
+        }
+    }
+    return (double) (now_ns() - t0) / calls;
+}
+
+static int bench_kernels(void) {
+    size_t bad = kernels_check(200 * bench_options.scale);
+    if (bad > 0) {
+        fprintf(stderr, "bench: the scanning kernels disagree with the scalar ones %zu times\n", bad);
+        return 1;
+    }
+
+    // a full root directory looked up by its last name or one it lacks, and a
+    // block table that is half free, with the value searched for at its end
+    static struct sfs_entry ents[SFS_ROOTDIR_NENTRIES];
+    static blockidx_t tbl[SFS_BLOCKTBL_NENTRIES];
+    char missing[SFS_FILENAME_MAX];
+    random_dir(ents, SFS_ROOTDIR_NENTRIES, SFS_ROOTDIR_NENTRIES * 1000, missing);
+    random_table(tbl, SFS_BLOCKTBL_NENTRIES);
+    for (size_t i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) {
+        if (tbl[i] == SFS_BLOCKIDX_END) {tbl[i] = 0;}
+    }
+    tbl[SFS_BLOCKTBL_NENTRIES - 1] = SFS_BLOCKIDX_END;
+
+    static const struct {
+        const char *name;
+        unsigned calls;
+    } kernels[] = {
+        {"dir_hit", 2000000},
+        {"dir_miss", 2000000},
+        {"free_map", 20000},
+        {"u16_find", 100000},
+    };
+    printf("%-9s %-7s %10s %8s\n", "kernel", "version", "ns/call", "speedup");
+    for (size_t w = 0; w < sizeof(kernels) / sizeof(kernels[0]); w++) {
+        unsigned calls = kernels[w].calls * bench_options.scale;
+        // the hit is the last entry, so both ends of the scan are the same
+        const char *name = w == 0 ? ents[SFS_ROOTDIR_NENTRIES - 1].filename : missing;
+        double scalar = 0;
+        for (size_t k = 0; k < NKERNEL_SETS; k++) {
+            if (!kernel_set_usable(&kernel_sets[k])) {continue;}
+            double ns = kernel_time(&kernel_sets[k], w, calls, ents, name, tbl);
+            if (k == 0) {scalar = ns;}
+            printf("%-9s %-7s %10.1f %7.2fx\n", kernels[w].name, kernel_sets[k].name, ns,
+                   scalar / ns);
+        }
+    }
+    return 0;
+}
+
+static void show_bench_help(const char *progname) {
+    printf("usage: %s [options] [workload...]\n\n", progname);
+    printf("Runs the workloads (default: all) against a freshly generated image,\n"
+           "calling the FUSE callbacks directly, without mounting anything.\n\n"
+           "benchmark options:\n"
+           "    -i, --img=FILE      image to generate and use (default: \"%s\")\n"
+           "        --seed=N        seed of the random workloads (default: 1)\n"
+           "        --scale=N       multiply the number of operations by N\n"
+           "                        (default: 1)\n"
+           "        --list          list the workloads\n"
+           "        --kernels       time the scanning kernels of each instruction\n"
+           "                        set against the scalar ones instead\n"
+           "and the options of sfs that change how the image is accessed, e.g.\n"
+           "--mmap, --uring, --cache=N, --writeback=S, --readahead=K.\n"
+           "\n", default_bench_img);
+}
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    options.img = default_bench_img;
+    options.writeback = 5;
+    options.readahead = 32;
+    bench_options.seed = 1;
+    bench_options.scale = 1;
+
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) != 0
+        || fuse_opt_parse(&args, &bench_options, bench_option_spec, NULL) != 0) {
+        return 1;
+    }
+    if (options.show_help) {
+        show_bench_help(argv[0]);
+        return 0;
+    }
+    if (bench_options.list) {
+        for (size_t w = 0; w < NWORKLOADS; w++) {printf("%s\n", workloads[w].name);}
+        return 0;
+    }
+    if (bench_options.scale == 0) {bench_options.scale = 1;}
+    if (bench_options.kernels) {return bench_kernels();}
+
+    // anything left must name a workload
+    int run[NWORKLOADS] = {0}, any = 0;
+    for (int i = 1; i < args.argc; i++) {
+        size_t w = 0;
+        while (w < NWORKLOADS && strcmp(args.argv[i], workloads[w].name) != 0) {w++;}
+        if (w == NWORKLOADS) {
+            fprintf(stderr, "bench: unknown workload or option '%s'\n", args.argv[i]);
+            return 1;
+        }
+        run[w] = any = 1;
+    }
+
+    make_image(options.img);
+    disk_open_image(options.img);
+    sfs_oper.init(NULL);
+
+    printf("%-9s %8s %10s %8s %8s %8s %9s %9s %9s %9s %9s\n", "workload", "ops", "ops/s",
+           "p50_us", "p90_us", "p99_us", "max_us", "reads", "read_kb", "writes", "write_kb");
+    struct run r = {NULL, 0, 0, 0, {0}};
+    for (size_t w = 0; w < NWORKLOADS; w++) {
+        if (any && !run[w]) {continue;}
+        workloads[w].fn(&r);
+    }
+    free(r.ns);
+
+    sfs_oper.destroy(NULL);
+    fuse_opt_free_args(&args);
+    return 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * Plays back a trace recorded with --trace=FILE (see the tracing section of
+ * sfs.c) against a local image, calling the callbacks of sfs_oper directly
+ * like bench.c does. Records are replayed one by one in the order of the
+ * trace, either at the pace at which they were recorded or as fast as
+ * possible (--max). Writes write a fixed pattern, as traces carry no data.
+ * Handles in the trace are mapped to those of the replay; calls on a handle
+ * whose open failed here go without one, or are skipped for a release. At the
+ * end the latency of every operation and the number of calls that failed are
+ * printed. The image is changed by the replay, so replay a copy.
+ *
+ * usage: ./replay [options] TRACE
+ * All options of sfs (e.g. -i IMAGE, --cache=N) apply; see --help.
+ */
+#define main sfs_main
+#include "sfs.c"
+#undef main
+
+/* Options of the replay itself, next to those of sfs */
+struct replay_options {
+    int max;
+} replay_options;
+
+static const struct fuse_opt replay_option_spec[] = {
+    { "--max", offsetof(struct replay_options, max), 1 },
+    FUSE_OPT_END
+};
+
+/* The handles of the trace that are open, with the file info of the replay */
+struct replay_file {
+    uint64_t fh;
+    struct fuse_file_info fi;
+};
+
+static struct replay_file *files = NULL;
+static size_t nfiles = 0, files_cap = 0;
+
+/* The latencies and failures of one operation */
+struct replay_op {
+    uint64_t *ns;
+    size_t n, cap;
+    size_t errors, skipped;
+};
+
+static struct replay_op ops[STATS_NOPS];
+
+static struct fuse_file_info *file_find(uint64_t fh) {
+    for (size_t i = 0; i < nfiles; i++) {
+        if (files[i].fh == fh) {return &files[i].fi;}
+    }
+    return NULL;
+}
+
+static void file_add(uint64_t fh, const struct fuse_file_info *fi) {
+    if (nfiles == files_cap) {
+        files_cap = files_cap ? 2 * files_cap : 64;
+        files = (struct replay_file *) realloc(files, files_cap * sizeof(struct replay_file));
+    }
+    files[nfiles].fh = fh;
+    files[nfiles].fi = *fi;
+    nfiles++;
+}
+
+static void file_drop(uint64_t fh) {
+    for (size_t i = 0; i < nfiles; i++) {
+        if (files[i].fh != fh) {continue;}
+        files[i] = files[--nfiles];
+        return;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static int fill_nothing(void *buf, const char *name, const struct stat *st, off_t off) {
+    (void) buf; (void) name; (void) st; (void) off;
+    return 0;
+}
+
+/*
+Function that returns a buffer of at least size bytes holding the write
+pattern. Reads never go into it, so the pattern stays as it is.
+*/
+static char *data_buf(size_t size) {
+    static char *buf = NULL;
+    static size_t cap = 0;
+    if (size > cap) {
+        buf = (char *) realloc(buf, size);
+        for (size_t i = cap; i < size; i++) {buf[i] = (char) (i * 31 + 7);}
+        cap = size;
+    }
+    return buf;
+}
+
+/*
+Function that returns a buffer of at least size bytes for reads to go into.
+*/
+static char *read_buf(size_t size) {
+    static char *buf = NULL;
+    static size_t cap = 0;
+    if (size > cap) {
+        buf = (char *) realloc(buf, size);
+        cap = size;
+    }
+    return buf;
+}
+
+/*
+Function that replays a single record. Returns the result of the callback, or
+sets *skipped if there was nothing to call.
+*/
+static int replay_rec(const struct trace_rec *rec, const char *path, const char *path2,
+                      int *skipped)
+{
+    struct fuse_file_info *fi = rec->has_fh ? file_find(rec->fh) : NULL;
+    struct fuse_file_info fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    fresh.flags = rec->flags;
+    struct stat st;
+    struct statvfs sv;
+    int r;
+
+    switch (rec->op) {
+    case STATS_GETATTR: return sfs_oper.getattr(path, &st);
+    case STATS_STATFS: return sfs_oper.statfs(path, &sv);
+    case STATS_READDIR: return sfs_oper.readdir(path, NULL, fill_nothing, rec->offset, NULL);
+    case STATS_OPEN:
+        r = sfs_oper.open(path, &fresh);
+        if (r == 0) {file_add(rec->fh, &fresh);}
+        return r;
+    case STATS_CREATE:
+        r = sfs_oper.create(path, rec->mode, &fresh);
+        if (r == 0) {file_add(rec->fh, &fresh);}
+        return r;
+    case STATS_RELEASE:
+        if (fi == NULL) {
+            *skipped = 1;
+            return 0;
+        }
+        r = sfs_oper.release(path, fi);
+        file_drop(rec->fh);
+        return r;
+    case STATS_FLUSH: return sfs_oper.flush(path, fi != NULL ? fi : &fresh);
+    case STATS_FSYNC: return sfs_oper.fsync(path, rec->mode, fi != NULL ? fi : &fresh);
+    case STATS_READ: return sfs_oper.read(path, read_buf(rec->size), rec->size, rec->offset, fi);
+    case STATS_WRITE: return sfs_oper.write(path, data_buf(rec->size), rec->size, rec->offset, fi);
+    case STATS_MKDIR: return sfs_oper.mkdir(path, rec->mode);
+    case STATS_RMDIR: return sfs_oper.rmdir(path);
+    case STATS_UNLINK: return sfs_oper.unlink(path);
+    case STATS_TRUNCATE: return sfs_oper.truncate(path, rec->size);
+    case STATS_FTRUNCATE:
+        if (fi == NULL) {return sfs_oper.truncate(path, rec->size);}
+        return sfs_oper.ftruncate(path, rec->size, fi);
+    case STATS_FALLOCATE: return sfs_oper.fallocate(path, rec->mode, rec->offset, rec->size, fi);
+    case STATS_RENAME: return sfs_oper.rename(path, path2);
+    default: // only the low-level API has these
+        *skipped = 1;
+        return 0;
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct_us(const struct replay_op *o, double q) {
+    size_t i = (size_t) (q * (o->n - 1) + 0.5);
+    return o->ns[i] / 1000.0;
+}
+
+static void print_ops(uint64_t elapsed, size_t nrecs, uint64_t behind) {
+    printf("replayed %zu records in %.3f s", nrecs, elapsed / 1e9);
+    if (!replay_options.max) {printf(", at most %.3f ms behind the trace", behind / 1e6);}
+    printf("\n\n%-10s %9s %8s %8s %9s %9s %9s %9s %9s\n", "op", "calls", "errors",
+           "skipped", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (size_t op = 0; op < STATS_NOPS; op++) {
+        struct replay_op *o = &ops[op];
+        if (o->n == 0 && o->skipped == 0) {continue;}
+        if (o->n == 0) {
+            printf("%-10s %9zu %8zu %8zu\n", stats_names[op], o->n, o->errors, o->skipped);
+            continue;
+        }
+        uint64_t total = 0;
+        for (size_t i = 0; i < o->n; i++) {total += o->ns[i];}
+        qsort(o->ns, o->n, sizeof(uint64_t), cmp_u64);
+        printf("%-10s %9zu %8zu %8zu %9.1f %9.1f %9.1f %9.1f %9.1f\n", stats_names[op], o->n,
+               o->errors, o->skipped, total / 1000.0 / o->n, pct_us(o, 0.5), pct_us(o, 0.9),
+               pct_us(o, 0.99), o->ns[o->n - 1] / 1000.0);
+    }
+}
+
+static void show_replay_help(const char *progname) {
+    printf("usage: %s [options] TRACE\n\n", progname);
+    printf("Plays back a trace recorded by sfs --trace=FILE against an image\n"
+           "(which it changes), calling the FUSE callbacks directly, without\n"
+           "mounting anything.\n\n"
+           "replay options:\n"
+           "    -i, --img=FILE      image to replay on (default: \"%s\")\n"
+           "        --max           replay as fast as possible instead of at\n"
+           "                        the pace of the trace\n"
+           "and the options of sfs that change how the image is accessed, e.g.\n"
+           "--mmap, --uring, --cache=N, --writeback=S, --readahead=K.\n"
+           "\n", default_img);
+}
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    options.img = default_img;
+    options.writeback = 5;
+    options.readahead = 32;
+
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) != 0
+        || fuse_opt_parse(&args, &replay_options, replay_option_spec, NULL) != 0) {
+        return 1;
+    }
+    if (options.show_help) {
+        show_replay_help(argv[0]);
+        return 0;
+    }
+    if (args.argc != 2) {
+        fprintf(stderr, "usage: %s [options] TRACE (see --help)\n", argv[0]);
+        return 1;
+    }
+
+    FILE *trace = fopen(args.argv[1], "rb");
+    if (trace == NULL) {
+        perror(args.argv[1]);
+        return 1;
+    }
+    struct trace_header h;
+    if (fread(&h, sizeof(h), 1, trace) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0) {
+        fprintf(stderr, "%s: not a trace\n", args.argv[1]);
+        return 1;
+    }
+    if (h.version != TRACE_VERSION || h.nops != STATS_NOPS) {
+        fprintf(stderr, "%s: trace of another version of sfs\n", args.argv[1]);
+        return 1;
+    }
+
+    // a replayed trace is not traced again
+    options.trace = NULL;
+    disk_open_image(options.img);
+    sfs_oper.init(NULL);
+
+    static char path[UINT16_MAX + 1], path2[UINT16_MAX + 1];
+    struct trace_rec rec;
+    size_t nrecs = 0;
+    uint64_t start = now_ns(), behind = 0;
+    while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+        if (fread(path, 1, rec.len, trace) != rec.len
+            || fread(path2, 1, rec.len2, trace) != rec.len2) {
+            fprintf(stderr, "%s: truncated after %zu records\n", args.argv[1], nrecs);
+            break;
+        }
+        path[rec.len] = '\0';
+        path2[rec.len2] = '\0';
+        nrecs++;
+        if (rec.op >= STATS_NOPS) {continue;}
+
+        if (!replay_options.max) {
+            uint64_t due = start + rec.ns, now = now_ns();
+            if (now < due) {
+                struct timespec t = {due / 1000000000ull, due % 1000000000ull};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+            } else if (now - due > behind) {
+                behind = now - due;
+            }
+        }
+
+        struct replay_op *o = &ops[rec.op];
+        // only a release may come without a path (of a file that was removed)
+        if (rec.len == 0 && rec.op != STATS_RELEASE) {
+            o->skipped++;
+            continue;
+        }
+        int skipped = 0;
+        uint64_t t0 = now_ns();
+        int r = replay_rec(&rec, rec.len > 0 ? path : NULL, path2, &skipped);
+        uint64_t t = now_ns() - t0;
+        if (skipped) {
+            o->skipped++;
+            continue;
+        }
+        if (r < 0) {o->errors++;}
+        if (o->n == o->cap) {
+            o->cap = o->cap ? 2 * o->cap : 1024;
+            o->ns = (uint64_t *) realloc(o->ns, o->cap * sizeof(uint64_t));
+        }
+        o->ns[o->n++] = t;
+    }
+    uint64_t elapsed = now_ns() - start;
+    fclose(trace);
+
+    // close what the trace left open, like the kernel does on unmount
+    while (nfiles > 0) {
+        sfs_oper.release(NULL, &files[nfiles - 1].fi);
+        nfiles--;
+    }
+    sfs_oper.destroy(NULL);
+
+    print_ops(elapsed, nrecs, behind);
+    fuse_opt_free_args(&args);
+    return 0;
+}
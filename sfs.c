@@ -2,12 +2,28 @@
 
 #include <errno.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
 
 #include "sfs.h"
 #include "diskio.h"
@@ -22,6 +38,16 @@ struct options {
     int verbose;
     int show_help;
     int show_fuse_help;
+    int mmap;
+    int uring;
+    int lowlevel;
+    unsigned cache;
+    unsigned writeback;
+    unsigned readahead;
+    int defrag;
+    int frag_report;
+    unsigned defrag_interval;
+    const char *trace;
 } options;
 
 
@@ -36,821 +62,4960 @@ struct options {
 const char* __asan_default_options() { return "detect_leaks=0"; }
 
 /*
-Function that reads in all directory entries from a certain directory
-Argument is pointer to the array of sfs_entry that needs to be filled,
-second argument is first block of the directory
+ * Statistics. Every callback counts its calls and its latency, the latter in
+ * a histogram of power-of-two buckets of microseconds (bucket 0 below 1us,
+ * bucket i from 2^(i-1) up to 2^i us). Below the block cache all reads and
+ * writes of the image are counted with their bytes, and the cache counts its
+ * hits and misses. Each thread counts in a block of its own, so counting
+ * costs two clock reads and no shared writes; the blocks are only summed when
+ * the statistics are printed: when the virtual file /.sfs_stats is opened
+ * (it is not listed in the root directory), and to stderr on SIGUSR1.
+ */
+enum stats_op {
+    STATS_GETATTR, STATS_LOOKUP, STATS_FORGET, STATS_SETATTR, STATS_STATFS, STATS_READDIR,
+    STATS_OPEN, STATS_RELEASE, STATS_FLUSH, STATS_FSYNC, STATS_READ, STATS_WRITE,
+    STATS_CREATE, STATS_MKDIR, STATS_UNLINK, STATS_RMDIR, STATS_RENAME, STATS_TRUNCATE,
+    STATS_FTRUNCATE, STATS_FALLOCATE, STATS_NOPS
+};
+
+static const char *const stats_names[STATS_NOPS] = {
+    "getattr", "lookup", "forget", "setattr", "statfs", "readdir",
+    "open", "release", "flush", "fsync", "read", "write",
+    "create", "mkdir", "unlink", "rmdir", "rename", "truncate",
+    "ftruncate", "fallocate"
+};
+
+enum stats_io {
+    STATS_READS, STATS_READ_BYTES, STATS_WRITES, STATS_WRITE_BYTES,
+    STATS_CACHE_HITS, STATS_CACHE_MISSES, STATS_NIO
+};
+
+#define STATS_NBUCKETS 32
+#define STATS_PATH "/.sfs_stats"
+// the inode of the file with the low-level API, beyond those of all slots
+#define STATS_INO ((fuse_ino_t) 0xffffffff)
+
+struct stats_block {
+    uint64_t calls[STATS_NOPS];
+    uint64_t ns[STATS_NOPS];
+    uint64_t max_ns[STATS_NOPS];
+    uint64_t hist[STATS_NOPS][STATS_NBUCKETS];
+    uint64_t io[STATS_NIO];
+    struct stats_block *next;
+};
+
+static struct stats_block *stats_blocks = NULL;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static int stats_pipe[2] = {-1, -1};
+static pthread_t stats_dumper;
+
+static void stats_key_init(void) {pthread_key_create(&stats_key, NULL);}
+
+/*
+Function that returns the block of the calling thread, adding one on first
+use. Blocks are never freed, so the counts of threads that ended remain.
 */
-static void load_dir(struct sfs_entry *dir, blockidx_t firstblock) {
-    // first block
-    disk_read(dir, SFS_BLOCK_SIZE, SFS_DATA_OFF + firstblock * SFS_BLOCK_SIZE);
-    // second block
-    blockidx_t *next = (blockidx_t*) malloc(sizeof(blockidx_t));
-    disk_read(next, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + firstblock * sizeof(blockidx_t));
-    disk_read(dir+SFS_BLOCK_SIZE/sizeof(struct sfs_entry), SFS_BLOCK_SIZE, SFS_DATA_OFF + *next * SFS_BLOCK_SIZE);
-    free(next);
-    return;
+static struct stats_block *stats_self(void) {
+    pthread_once(&stats_once, stats_key_init);
+    struct stats_block *b = (struct stats_block *) pthread_getspecific(stats_key);
+    if (b == NULL) {
+        b = (struct stats_block *) calloc(1, sizeof(struct stats_block));
+        pthread_mutex_lock(&stats_lock);
+        b->next = stats_blocks;
+        stats_blocks = b;
+        pthread_mutex_unlock(&stats_lock);
+        pthread_setspecific(stats_key, b);
+    }
+    return b;
 }
 
-static int count_blocks(blockidx_t firstblock) {
-    blockidx_t curr = firstblock;
-    int count = 0;
+// only the owning thread writes a counter, but others read it while printing
+static void stats_add(uint64_t *c, uint64_t n) {
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
 
-    while (curr != SFS_BLOCKIDX_END) {
-        disk_read(
-            &curr,
-            sizeof(blockidx_t),
-            SFS_BLOCKTBL_OFF + curr * sizeof(blockidx_t)
-        );
-        count ++;
-    }
+static void stats_io(enum stats_io which, uint64_t n) {stats_add(&stats_self()->io[which], n);}
 
-    return count;
+struct stats_timer {
+    enum stats_op op;
+    struct timespec start;
+};
+
+static struct stats_timer stats_begin(enum stats_op op) {
+    struct stats_timer t = {op, {0, 0}};
+    clock_gettime(CLOCK_MONOTONIC, &t.start);
+    return t;
 }
 
-static void read_file(char *buf, blockidx_t firstblock) {
-    blockidx_t curr = firstblock;
-    size_t blocks_read = 0;
-    while (curr != SFS_BLOCKIDX_END) {
-        // Read from the data
-        disk_read(
-            (buf+blocks_read*SFS_BLOCK_SIZE), 
-            SFS_BLOCK_SIZE, 
-            SFS_DATA_OFF + curr * SFS_BLOCK_SIZE
-        );
+static void stats_end(struct stats_timer *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (uint64_t) (now.tv_sec - t->start.tv_sec) * 1000000000ull
+                  + now.tv_nsec - t->start.tv_nsec;
+    uint64_t us = ns / 1000;
+    size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= STATS_NBUCKETS) {bucket = STATS_NBUCKETS - 1;}
+
+    struct stats_block *b = stats_self();
+    stats_add(&b->calls[t->op], 1);
+    stats_add(&b->ns[t->op], ns);
+    stats_add(&b->hist[t->op][bucket], 1);
+    if (ns > b->max_ns[t->op]) {__atomic_store_n(&b->max_ns[t->op], ns, __ATOMIC_RELAXED);}
+}
 
-        blocks_read ++;
+/*
+Macro that times the rest of the enclosing block as operation op; the timer
+is stopped on every way out of it.
+*/
+#define STATS_TIME(op) \
+    struct stats_timer stats_timer __attribute__((cleanup(stats_end))) = stats_begin(op)
 
-        // Read what next block id is
-        disk_read(
-            &curr,
-            sizeof(blockidx_t),
-            SFS_BLOCKTBL_OFF + curr * sizeof(blockidx_t)
-        );
+/*
+Function that returns the upper bound in microseconds of the bucket in which
+the fraction q of the calls in hist falls.
+*/
+static uint64_t stats_quantile(const uint64_t *hist, uint64_t calls, double q) {
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_NBUCKETS; i++) {
+        seen += hist[i];
+        if (seen > 0 && seen >= q * calls) {return (uint64_t) 1 << i;}
     }
+    return (uint64_t) 1 << (STATS_NBUCKETS - 1);
 }
 
 /*
-Function that seperates the last part of a path and returns the parent path
+Function that prints the statistics of all threads together to f: a line per
+operation that was called, its histogram, and the I/O counters.
 */
-static void get_parent(const char *path, char *parent_path) {
-    strcpy(parent_path, path);
-    char* child = strrchr(parent_path, '/');
-    child[0] = '\0';
-    return;
+static void stats_print(FILE *f) {
+    struct stats_block total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&stats_lock);
+    for (struct stats_block *b = stats_blocks; b != NULL; b = b->next) {
+        for (size_t op = 0; op < STATS_NOPS; op++) {
+            total.calls[op] += __atomic_load_n(&b->calls[op], __ATOMIC_RELAXED);
+            total.ns[op] += __atomic_load_n(&b->ns[op], __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&b->max_ns[op], __ATOMIC_RELAXED);
+            if (max > total.max_ns[op]) {total.max_ns[op] = max;}
+            for (size_t i = 0; i < STATS_NBUCKETS; i++) {
+                total.hist[op][i] += __atomic_load_n(&b->hist[op][i], __ATOMIC_RELAXED);
+            }
+        }
+        for (size_t i = 0; i < STATS_NIO; i++) {
+            total.io[i] += __atomic_load_n(&b->io[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    fprintf(f, "%-10s %10s %12s %9s %9s %9s %9s %9s\n",
+            "op", "calls", "total_us", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (size_t op = 0; op < STATS_NOPS; op++) {
+        uint64_t calls = total.calls[op];
+        if (calls == 0) {continue;}
+        uint64_t max = total.max_ns[op] / 1000, q[3];
+        q[0] = stats_quantile(total.hist[op], calls, 0.5);
+        q[1] = stats_quantile(total.hist[op], calls, 0.9);
+        q[2] = stats_quantile(total.hist[op], calls, 0.99);
+        // a bucket bound may lie above the slowest call
+        for (size_t i = 0; i < 3; i++) {
+            if (q[i] > max) {q[i] = max;}
+        }
+        fprintf(f, "%-10s %10llu %12llu %9llu %9llu %9llu %9llu %9llu\n", stats_names[op],
+                (unsigned long long) calls, (unsigned long long) (total.ns[op] / 1000),
+                (unsigned long long) (total.ns[op] / calls / 1000), (unsigned long long) q[0],
+                (unsigned long long) q[1], (unsigned long long) q[2], (unsigned long long) max);
+    }
+
+    fprintf(f, "\nhistograms (calls below N us)\n");
+    for (size_t op = 0; op < STATS_NOPS; op++) {
+        if (total.calls[op] == 0) {continue;}
+        fprintf(f, "%-10s", stats_names[op]);
+        for (size_t i = 0; i < STATS_NBUCKETS; i++) {
+            if (total.hist[op][i] == 0) {continue;}
+            fprintf(f, " <%llu:%llu", 1ull << i, (unsigned long long) total.hist[op][i]);
+        }
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, "\nimage reads %llu (%llu bytes), writes %llu (%llu bytes)\n",
+            (unsigned long long) total.io[STATS_READS],
+            (unsigned long long) total.io[STATS_READ_BYTES],
+            (unsigned long long) total.io[STATS_WRITES],
+            (unsigned long long) total.io[STATS_WRITE_BYTES]);
+    fprintf(f, "cache hits %llu, misses %llu\n",
+            (unsigned long long) total.io[STATS_CACHE_HITS],
+            (unsigned long long) total.io[STATS_CACHE_MISSES]);
 }
 
 /*
-Function that seperates the last part of a path and returns the child name*/
-static void get_child(const char *path, char **newdir) {
-    const char delim = '/';
-    *newdir = strrchr(path, delim) + 1;
-    return;
+ * The virtual file. Its contents are printed once when it is opened and kept
+ * with the open file, so reads in pieces see one consistent snapshot; it is
+ * opened with direct_io as its size changes all the time, so its size is
+ * given as 0 and reads go on until they reach the end of the snapshot. Its
+ * name is reserved: it cannot be created, removed, truncated or renamed, so
+ * no entry on disk can hide behind it.
+ */
+struct stats_snapshot {
+    char *text;
+    size_t len;
+};
+
+static int stats_path(const char *path) {return path != NULL && strcmp(path, STATS_PATH) == 0;}
+
+static int stats_name(fuse_ino_t parent, const char *name) {
+    return parent == FUSE_ROOT_ID && strcmp(name, STATS_PATH + 1) == 0;
+}
+
+static void stats_render(struct stats_snapshot *s) {
+    s->text = NULL;
+    s->len = 0;
+    FILE *f = open_memstream(&s->text, &s->len);
+    if (f == NULL) {return;}
+    stats_print(f);
+    fclose(f);
+}
+
+static void stats_stat(struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = time(NULL);
+    st->st_mtime = time(NULL);
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = 0;
+}
+
+static int stats_open(struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {return -EACCES;}
+    struct stats_snapshot *s = (struct stats_snapshot *) malloc(sizeof(struct stats_snapshot));
+    stats_render(s);
+    if (s->text == NULL) {
+        free(s);
+        return -ENOMEM;
+    }
+    fi->direct_io = 1;
+    fi->fh = (uint64_t) (uintptr_t) s;
+    return 0;
+}
+
+static int stats_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset) {
+    struct stats_snapshot *s = (struct stats_snapshot *) (uintptr_t) fi->fh;
+    if (offset >= (off_t) s->len) {return 0;}
+    if (size > s->len - offset) {size = s->len - offset;}
+    memcpy(buf, s->text + offset, size);
+    return size;
+}
+
+static void stats_close(struct fuse_file_info *fi) {
+    struct stats_snapshot *s = (struct stats_snapshot *) (uintptr_t) fi->fh;
+    free(s->text);
+    free(s);
 }
 
 /*
-Function to check if the file or directory at path is in the root directory*/
-static int in_root(const char *path) {
-    int count = 0;
-    for (size_t i = 0; i < strlen(path); i++)
-    {
-        if (path[i] == '/') {count++;}
+ * SIGUSR1 prints the statistics to stderr. The handler can do hardly anything
+ * safely, so it only writes a byte into a pipe, and a thread that waits on the
+ * other end does the printing.
+ */
+static void stats_signal(int sig) {
+    (void) sig;
+    char c = 0;
+    if (write(stats_pipe[1], &c, 1) < 0) {return;}
+}
+
+static void *stats_dump(void *arg) {
+    (void) arg;
+    char c;
+    while (read(stats_pipe[0], &c, 1) > 0) {
+        stats_print(stderr);
+        fflush(stderr);
     }
-    if (count == 1) {return 1;} else {return 0;}
+    return NULL;
 }
 
+static void stats_start(void) {
+    if (pipe(stats_pipe) != 0) {
+        perror("stats: pipe");
+        return;
+    }
+    if (pthread_create(&stats_dumper, NULL, stats_dump, NULL) != 0) {
+        close(stats_pipe[0]);
+        close(stats_pipe[1]);
+        stats_pipe[0] = stats_pipe[1] = -1;
+        return;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stats_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
 
+static void stats_stop(void) {
+    if (stats_pipe[1] < 0) {return;}
+    signal(SIGUSR1, SIG_IGN);
+    close(stats_pipe[1]);
+    pthread_join(stats_dumper, NULL);
+    close(stats_pipe[0]);
+    stats_pipe[0] = stats_pipe[1] = -1;
+}
 
 /*
- * This is a helper function that is optional, but highly recomended you
- * implement and use. Given a path, it looks it up on disk. It will return 0 on
- * success, and a non-zero value on error (e.g., the file did not exist).
- * The resulting directory entry is placed in the memory pointed to by
- * ret_entry. Additionally it can return the offset of that direntry on disk in
- * ret_entry_off, which you can use to update the entry and write it back to
- * disk (e.g., rmdir, unlink, truncate, write).
- *
- * You can start with implementing this function to work just for paths in the
- * root entry, and later modify it to also work for paths with subdirectories.
- * This way, all of your other functions can use this helper and will
- * automatically support subdirectories. To make this function support
- * subdirectories, we recommend you refactor this function to be recursive, and
- * take the current directory as argument as well. For example:
- *
- *  static int get_entry_rec(const char *path, const struct sfs_entry *parent,
- *                           size_t parent_nentries, blockidx_t parent_blockidx,
- *                           struct sfs_entry *ret_entry,
- *                           unsigned *ret_entry_off)
- *
- * Here parent is the directory it is currently searching (at first the rootdir,
- * later the subdir). The parent_nentries tells the function how many entries
- * there are in the directory (SFS_ROOTDIR_NENTRIES or SFS_DIR_NENTRIES).
- * Finally, the parent_blockidx contains the blockidx of the given directory on
- * the disk, which will help in calculating ret_entry_off.
+ * Tracing, enabled with --trace=FILE. Every callback of the path API appends
+ * a record to FILE: the operation (numbered as in enum stats_op), the time it
+ * started, its path(s), offset, size, mode and flags, and its file handle
+ * (for an open or create the new one, set by the call). File contents are not
+ * recorded, so a trace shows how an image is used but not what is in it. A
+ * record is written when its call returns, so it only refers to handles of
+ * records before it; replay.c plays a trace back. With the low-level API there
+ * are no paths to record, so there is no tracing.
  */
+#define TRACE_MAGIC "SFSTRACE"
+#define TRACE_VERSION 1
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nops;
+} __attribute__((__packed__));
+
+/* A record, followed by len bytes of path and len2 bytes of the new path of a rename */
+struct trace_rec {
+    uint64_t ns;
+    uint64_t fh;
+    int64_t offset;
+    uint64_t size;
+    uint32_t mode;
+    uint32_t flags;
+    uint8_t op;
+    uint8_t has_fh;
+    uint16_t len;
+    uint16_t len2;
+} __attribute__((__packed__));
+
+static FILE *trace_file = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec trace_epoch;
+
+struct trace_call {
+    int on;
+    struct trace_rec rec;
+    const char *path, *path2;
+    struct fuse_file_info *fi;
+};
 
-static int get_entry_rec(const char *path, struct sfs_entry *parent,
-                           size_t parent_nentries,
-                           blockidx_t *parent_blockidx,
-                           char *token,
-                           struct sfs_entry *ret_entry,
-                           unsigned *ret_entry_off) 
+static struct trace_call trace_begin(enum stats_op op, const char *path, const char *path2,
+                                     off_t offset, uint64_t size, uint32_t mode,
+                                     struct fuse_file_info *fi)
 {
-    struct sfs_entry *ent;
-    for (size_t i = 0; i < parent_nentries; i++)
-    {
-        ent = parent + i;
-        if (strcmp(token, ent->filename) == 0) {
-            token = strtok(NULL, "/");
-            if (token == NULL) {
-                // We have reached end of path
-                *ret_entry = *ent;
-                *ret_entry_off = i;
-                return 0;
+    struct trace_call c;
+    c.on = trace_file != NULL;
+    if (!c.on) {return c;}
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&c.rec, 0, sizeof(c.rec));
+    c.rec.ns = (uint64_t) (now.tv_sec - trace_epoch.tv_sec) * 1000000000ull
+               + now.tv_nsec - trace_epoch.tv_nsec;
+    c.rec.op = op;
+    c.rec.offset = offset;
+    c.rec.size = size;
+    c.rec.mode = mode;
+    c.rec.flags = fi != NULL ? (uint32_t) fi->flags : 0;
+    c.rec.fh = fi != NULL ? fi->fh : 0;
+    c.path = path;
+    c.path2 = path2;
+    c.fi = fi;
+    return c;
+}
+
+static void trace_end(struct trace_call *c) {
+    if (!c->on) {return;}
+    c->rec.has_fh = c->fi != NULL;
+    // release clears the handle, open and create set it
+    if (c->fi != NULL && c->rec.fh == 0) {c->rec.fh = c->fi->fh;}
+    c->rec.len = c->path != NULL ? strlen(c->path) : 0;
+    c->rec.len2 = c->path2 != NULL ? strlen(c->path2) : 0;
+
+    pthread_mutex_lock(&trace_lock);
+    fwrite(&c->rec, sizeof(c->rec), 1, trace_file);
+    if (c->rec.len > 0) {fwrite(c->path, 1, c->rec.len, trace_file);}
+    if (c->rec.len2 > 0) {fwrite(c->path2, 1, c->rec.len2, trace_file);}
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+Macro that records the enclosing callback in the trace when it returns.
+*/
+#define TRACE_CALL(op, path, path2, offset, size, mode, fi) \
+    struct trace_call trace_call __attribute__((cleanup(trace_end))) = \
+        trace_begin(op, path, path2, offset, size, mode, fi)
+
+static void trace_start(const char *file) {
+    if (file == NULL) {return;}
+    trace_file = fopen(file, "wb");
+    if (trace_file == NULL) {
+        perror(file);
+        exit(1);
+    }
+    // records are small, so write them in big pieces
+    setvbuf(trace_file, NULL, _IOFBF, 1 << 20);
+    struct trace_header h = {TRACE_MAGIC, TRACE_VERSION, STATS_NOPS};
+    fwrite(&h, sizeof(h), 1, trace_file);
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+}
+
+static void trace_stop(void) {
+    if (trace_file == NULL) {return;}
+    pthread_mutex_lock(&trace_lock);
+    if (fclose(trace_file) != 0) {perror("trace");}
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * Scratch memory for buffers that only live during one call. Each thread
+ * bumps through chunks of its own, so taking a buffer costs no lock and no
+ * malloc once the chunks are there. A function that takes scratch buffers
+ * starts with SCRATCH_SCOPE(), which gives all it took back when it returns,
+ * on any path, so error returns cannot leak them. Chunks stay with their
+ * thread for the next call, except those bigger than SCRATCH_CHUNK (for a
+ * single big buffer), which are freed when the outermost scope ends.
+ */
+#define SCRATCH_CHUNK (256u << 10)
+
+struct scratch_chunk {
+    struct scratch_chunk *next;
+    size_t size, used;
+    char data[] __attribute__((aligned(16)));
+};
+
+struct scratch {
+    struct scratch_chunk *first, *cur; // cur is NULL before the first chunk is used
+    unsigned depth;
+};
+
+struct scratch_scope {
+    struct scratch_chunk *chunk;
+    size_t used;
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_free(void *arg) {
+    struct scratch *s = (struct scratch *) arg;
+    while (s->first != NULL) {
+        struct scratch_chunk *c = s->first;
+        s->first = c->next;
+        free(c);
+    }
+    free(s);
+}
+
+static void scratch_key_init(void) {pthread_key_create(&scratch_key, scratch_free);}
+
+static struct scratch *scratch_self(void) {
+    pthread_once(&scratch_once, scratch_key_init);
+    struct scratch *s = (struct scratch *) pthread_getspecific(scratch_key);
+    if (s == NULL) {
+        s = (struct scratch *) calloc(1, sizeof(struct scratch));
+        pthread_setspecific(scratch_key, s);
+    }
+    return s;
+}
+
+/*
+Function that returns a buffer of size bytes (aligned to 16), which is valid
+until the innermost scope of the caller ends.
+*/
+static void *scratch_alloc(size_t size) {
+    struct scratch *s = scratch_self();
+    assert(s->depth > 0);
+    size = (size + 15) & ~(size_t) 15;
+    while (s->cur == NULL || s->cur->size - s->cur->used < size) {
+        // the chunks after cur are all unused
+        struct scratch_chunk **next = s->cur == NULL ? &s->first : &s->cur->next;
+        if (*next == NULL || (*next)->size < size) {
+            size_t csize = size > SCRATCH_CHUNK ? size : SCRATCH_CHUNK;
+            struct scratch_chunk *c = (struct scratch_chunk *) malloc(sizeof(*c) + csize);
+            c->size = csize;
+            c->next = *next;
+            *next = c;
+        }
+        s->cur = *next;
+        s->cur->used = 0;
+    }
+    void *p = s->cur->data + s->cur->used;
+    s->cur->used += size;
+    return p;
+}
+
+static struct scratch_scope scratch_begin(void) {
+    struct scratch *s = scratch_self();
+    s->depth++;
+    struct scratch_scope m = {s->cur, s->cur != NULL ? s->cur->used : 0};
+    return m;
+}
+
+static void scratch_end(struct scratch_scope *m) {
+    struct scratch *s = scratch_self();
+    s->cur = m->chunk;
+    if (s->cur != NULL) {s->cur->used = m->used;}
+    if (--s->depth > 0) {return;}
+
+    for (struct scratch_chunk **c = &s->first; *c != NULL;) {
+        if ((*c)->size <= SCRATCH_CHUNK) {
+            c = &(*c)->next;
+            continue;
+        }
+        struct scratch_chunk *big = *c;
+        *c = big->next;
+        free(big);
+    }
+}
+
+#define SCRATCH_SCOPE() \
+    struct scratch_scope scratch_scope __attribute__((cleanup(scratch_end))) = scratch_begin()
+
+/*
+ * Access to the image. By default all I/O goes through disk_read and
+ * disk_write from diskio.h. With the --mmap option the whole image is mapped
+ * into memory instead, so I/O becomes a memcpy, and hot paths can use
+ * img_ptr to look at the mapped bytes directly without copying them at all.
+ * With the --uring option the image is opened again and batches of requests
+ * (see struct img_batch) are submitted through io_uring. FUSE calls us from
+ * several threads, so every thread gets a ring of its own on first use.
+ * With the --cache option img_read and img_write go through a write-back
+ * block cache (see below) on top of whichever of these is used.
+ */
+static char *img_map = NULL;
+static size_t img_map_size = 0;
+
+static int img_fd = -1;
+
+struct img_ring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_size, cq_size, sqes_size;
+};
+
+static int uring_ok = 0;
+static pthread_key_t ring_key;
+
+#define IMG_BATCH_MAX 64
+
+/*
+Function that maps the image into memory. On failure a warning is printed and
+the driver keeps using diskio.
+*/
+static void img_mmap(const char *filename) {
+    int fd = open(filename, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("mmap: cannot open image, using diskio");
+        if (fd >= 0) {close(fd);}
+        return;
+    }
+    // a short image would fault on the first access past its end
+    off_t need = SFS_DATA_OFF + (off_t) SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE;
+    if (st.st_size < need) {
+        fprintf(stderr, "mmap: image is %lld bytes, expected %lld, using diskio\n",
+                (long long) st.st_size, (long long) need);
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap: cannot map image, using diskio");
+        return;
+    }
+    img_map = (char *) map;
+    img_map_size = st.st_size;
+}
+
+/*
+Function that sets up an io_uring for the calling thread, or returns NULL.
+*/
+static struct img_ring *ring_setup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, IMG_BATCH_MAX, &p);
+    if (fd < 0) {return NULL;}
+
+    struct img_ring *r = (struct img_ring *) calloc(1, sizeof(struct img_ring));
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    char *sq = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sq != MAP_FAILED) {munmap(sq, r->sq_size);}
+        if (cq != MAP_FAILED) {munmap(cq, r->cq_size);}
+        if (sqes != MAP_FAILED) {munmap(sqes, r->sqes_size);}
+        close(fd); free(r);
+        return NULL;
+    }
+
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    r->sqes = (struct io_uring_sqe *) sqes;
+    r->sq_map = sq;
+    r->cq_map = cq;
+    r->fd = fd;
+    return r;
+}
+
+/*
+Function that tears down the ring of a thread when that thread exits.
+*/
+static void ring_free(void *arg) {
+    struct img_ring *r = (struct img_ring *) arg;
+    munmap(r->sq_map, r->sq_size);
+    munmap(r->cq_map, r->cq_size);
+    munmap(r->sqes, r->sqes_size);
+    close(r->fd);
+    free(r);
+}
+
+/*
+Function that returns the ring of the calling thread, setting it up on first
+use, or NULL if io_uring is not used.
+*/
+static struct img_ring *thread_ring(void) {
+    if (!uring_ok) {return NULL;}
+    struct img_ring *r = (struct img_ring *) pthread_getspecific(ring_key);
+    if (r == NULL) {
+        r = ring_setup();
+        if (r != NULL) {pthread_setspecific(ring_key, r);}
+    }
+    return r;
+}
+
+/*
+Function that opens the image for the io_uring backend and checks that rings
+can be set up. If io_uring is not available, I/O falls back to pread/pwrite
+on the image; if the image cannot be opened at all the driver keeps using
+diskio.
+*/
+static void img_uring(const char *filename) {
+    img_fd = open(filename, O_RDWR);
+    if (img_fd < 0) {
+        perror("uring: cannot open image, using diskio");
+        return;
+    }
+
+    struct img_ring *r = ring_setup();
+    if (r == NULL) {
+        perror("uring: io_uring unavailable, using pread/pwrite");
+        return;
+    }
+    pthread_key_create(&ring_key, ring_free);
+    pthread_setspecific(ring_key, r);
+    uring_ok = 1;
+}
+
+/*
+Function that does (the rest of) one request with pread/pwrite on img_fd.
+*/
+static void img_pio(int write, char *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t r = write ? pwrite(img_fd, buf, size, offset) : pread(img_fd, buf, size, offset);
+        if (r < 0 && errno == EINTR) {continue;}
+        if (r <= 0) {
+            perror(write ? "pwrite" : "pread");
+            exit(1);
+        }
+        buf += r; size -= r; offset += r;
+    }
+}
+
+static void img_raw_read(void *buf, size_t size, off_t offset) {
+    stats_io(STATS_READS, 1);
+    stats_io(STATS_READ_BYTES, size);
+    if (img_map != NULL) {
+        memcpy(buf, img_map + offset, size);
+    } else if (img_fd >= 0) {
+        img_pio(0, (char *) buf, size, offset);
+    } else {
+        disk_read(buf, size, offset);
+    }
+}
+
+static void img_raw_write(const void *buf, size_t size, off_t offset) {
+    stats_io(STATS_WRITES, 1);
+    stats_io(STATS_WRITE_BYTES, size);
+    if (img_map != NULL) {
+        memmove(img_map + offset, buf, size);
+    } else if (img_fd >= 0) {
+        img_pio(1, (char *) buf, size, offset);
+    } else {
+        disk_write(buf, size, offset);
+    }
+}
+
+/*
+ * A batch of independent reads or writes on the image (the order in which they
+ * are done is not defined). With io_uring all requests of a batch are
+ * submitted together, otherwise they are simply done one by one. batch_add
+ * submits by itself when the batch is full, and batch_submit must be called
+ * before any buffer of the batch is used. batch_queue is batch_add below the
+ * block cache, which uses it to write back dirty lines.
+ */
+struct img_batch {
+    int write;
+    size_t n;
+    struct {
+        char *buf;
+        size_t size;
+        off_t offset;
+    } reqs[IMG_BATCH_MAX];
+};
+
+static void batch_init(struct img_batch *b, int write) {
+    b->write = write;
+    b->n = 0;
+}
+
+static void batch_submit(struct img_batch *b) {
+    struct img_ring *ring = thread_ring();
+    if (ring == NULL) {
+        for (size_t i = 0; i < b->n; i++) {
+            if (b->write) {
+                img_raw_write(b->reqs[i].buf, b->reqs[i].size, b->reqs[i].offset);
             } else {
-                // Need to read in the next dir
-                struct sfs_entry *newparent = (struct sfs_entry*) malloc(SFS_DIR_SIZE);
-                load_dir(newparent, ent->first_block);
+                img_raw_read(b->reqs[i].buf, b->reqs[i].size, b->reqs[i].offset);
+            }
+        }
+        b->n = 0;
+        return;
+    }
 
-                *parent_blockidx = ent->first_block;
-                int r = get_entry_rec(path, newparent, SFS_DIR_NENTRIES, parent_blockidx, token, ret_entry, ret_entry_off);
+    unsigned tail = *ring->sq_tail;
+    for (size_t i = 0; i < b->n; i++) {
+        unsigned idx = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = b->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = img_fd;
+        sqe->addr = (uintptr_t) b->reqs[i].buf;
+        sqe->len = b->reqs[i].size;
+        sqe->off = b->reqs[i].offset;
+        sqe->user_data = i;
+        ring->sq_array[idx] = idx;
+        tail++;
+        stats_io(b->write ? STATS_WRITES : STATS_READS, 1);
+        stats_io(b->write ? STATS_WRITE_BYTES : STATS_READ_BYTES, b->reqs[i].size);
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    // the kernel may take fewer requests than asked (it stops after one it
+    // cannot prepare, or when it is out of resources); it does not wait for
+    // completions then, and the rest is submitted on the next round
+    size_t submitted = 0, done = 0;
+    while (done < b->n) {
+        int r = syscall(__NR_io_uring_enter, ring->fd, b->n - submitted, b->n - done,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r >= 0) {
+            submitted += r;
+        } else if (errno == EAGAIN || errno == EBUSY) {
+            // make room by waiting for one of those in flight
+            if (submitted > done) {
+                syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            } else {
+                sched_yield();
+            }
+        } else if (errno != EINTR) {
+            perror("io_uring_enter");
+            exit(1);
+        }
 
-                free(newparent);
-                return r;
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            size_t i = cqe->user_data;
+            // short or failed (e.g. opcode unsupported): finish with pread/pwrite
+            size_t got = cqe->res > 0 ? (size_t) cqe->res : 0;
+            if (got < b->reqs[i].size) {
+                img_pio(b->write, b->reqs[i].buf + got, b->reqs[i].size - got, b->reqs[i].offset + got);
             }
-        } 
+            head++;
+            done++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
     }
-    return -ENOENT;
+    b->n = 0;
 }
 
-static int get_entry(const char *path, struct sfs_entry *ret_entry,
-                     unsigned *ret_entry_off, blockidx_t *parent_blockidx)
-{
-    /* Get the next component of the path. Make sure to not modify path if it is
-     * the value passed by libfuse (i.e., make a copy). Note that strtok
-     * modifies the string you pass it. */
+static void batch_queue(struct img_batch *b, const void *buf, size_t size, off_t offset) {
+    if (b->n == IMG_BATCH_MAX) {batch_submit(b);}
+    b->reqs[b->n].buf = (char *) buf;
+    b->reqs[b->n].size = size;
+    b->reqs[b->n].offset = offset;
+    b->n++;
+}
+
+/*
+ * Write-back cache of image blocks, enabled with --cache=N (N lines). All of
+ * the image after the magic number, so the root directory, the block table and
+ * the data area, is cut into lines of SFS_BLOCK_SIZE bytes counted from
+ * SFS_ROOTDIR_OFF; a data block is exactly one line. Writes only change the
+ * cached lines and mark them dirty. Dirty lines reach the image when they are
+ * evicted (least recently used first) or when cache_flush runs: on fsync,
+ * flush, release and unmount, and every --writeback seconds from a background
+ * thread. cache_flush merges dirty lines that follow each other on disk into
+ * one write. With --mmap there is no cache, since the mapping already is one
+ * (so img_ptr never has to bypass it).
+ *
+ * cache_lock is a leaf lock that protects all lines. Lines that are missing on
+ * a read are read from the image without holding it; they are only added to
+ * the cache if no write went through the cache in the meantime (cache_gen).
+ */
+#define CACHE_NLINES ((SFS_DATA_OFF - SFS_ROOTDIR_OFF) / SFS_BLOCK_SIZE + SFS_BLOCKTBL_NENTRIES)
+#define CACHE_NONE UINT32_MAX
+
+struct cache_line {
+    uint32_t line;
+    int dirty;
+    struct cache_line *prev, *next;
+    char data[SFS_BLOCK_SIZE];
+};
+
+static struct cache_line *cache_lines = NULL;
+static struct cache_line **cache_map = NULL;
+static struct cache_line cache_lru;
+static size_t cache_ndirty = 0;
+static unsigned long cache_gen = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t cache_thread;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static int cache_running = 0;
+
+static uint32_t cache_line_of(off_t offset) {return (offset - SFS_ROOTDIR_OFF) / SFS_BLOCK_SIZE;}
+static size_t cache_line_in(off_t offset) {return (offset - SFS_ROOTDIR_OFF) % SFS_BLOCK_SIZE;}
+static off_t cache_line_off(uint32_t line) {return SFS_ROOTDIR_OFF + (off_t) line * SFS_BLOCK_SIZE;}
+
+/*
+Function that moves c to the front of the LRU list.
+*/
+static void cache_touch(struct cache_line *c) {
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    c->next = cache_lru.next;
+    c->prev = &cache_lru;
+    cache_lru.next->prev = c;
+    cache_lru.next = c;
+}
+
+/*
+Function that sets up a cache of nlines lines, which all start out unused at
+the back of the LRU list.
+*/
+static void cache_init(size_t nlines) {
+    if (nlines > CACHE_NLINES) {nlines = CACHE_NLINES;}
+    cache_lines = (struct cache_line *) calloc(nlines, sizeof(struct cache_line));
+    cache_map = (struct cache_line **) calloc(CACHE_NLINES, sizeof(struct cache_line *));
+    cache_lru.prev = cache_lru.next = &cache_lru;
+    for (size_t i = 0; i < nlines; i++) {
+        struct cache_line *c = &cache_lines[i];
+        c->line = CACHE_NONE;
+        c->prev = cache_lru.prev;
+        c->next = &cache_lru;
+        cache_lru.prev->next = c;
+        cache_lru.prev = c;
+    }
+}
+
+/*
+Function that returns the cached line `line` (marking it used), or NULL.
+cache_lock must be held.
+*/
+static struct cache_line *cache_get(uint32_t line) {
+    struct cache_line *c = cache_map[line];
+    if (c != NULL) {cache_touch(c);}
+    return c;
+}
+
+/*
+Function that evicts the least recently used line, writing it back if it is
+dirty, and reuses it for `line`. The data of the returned line is undefined.
+cache_lock must be held.
+*/
+static struct cache_line *cache_take(uint32_t line) {
+    struct cache_line *c = cache_lru.prev;
+    if (c->dirty) {
+        img_raw_write(c->data, SFS_BLOCK_SIZE, cache_line_off(c->line));
+        c->dirty = 0;
+        cache_ndirty--;
+    }
+    if (c->line != CACHE_NONE) {cache_map[c->line] = NULL;}
+    c->line = line;
+    cache_map[line] = c;
+    cache_touch(c);
+    return c;
+}
+
+static void cache_read(char *buf, size_t size, off_t offset) {
+    SCRATCH_SCOPE();
+    while (size > 0) {
+        // copy the cached lines at the start
+        pthread_mutex_lock(&cache_lock);
+        struct cache_line *c;
+        while (size > 0 && (c = cache_get(cache_line_of(offset))) != NULL) {
+            size_t in = cache_line_in(offset);
+            size_t n = size < SFS_BLOCK_SIZE - in ? size : SFS_BLOCK_SIZE - in;
+            memcpy(buf, c->data + in, n);
+            buf += n; size -= n; offset += n;
+            stats_io(STATS_CACHE_HITS, 1);
+        }
+
+        // and read the missing lines after them from the image in one go
+        uint32_t first = cache_line_of(offset), last = first;
+        while (size > 0 && cache_line_off(last + 1) < offset + (off_t) size
+               && cache_map[last + 1] == NULL) {
+            last++;
+        }
+        unsigned long gen = cache_gen;
+        pthread_mutex_unlock(&cache_lock);
+        if (size == 0) {break;}
+
+        size_t nlines = last - first + 1;
+        stats_io(STATS_CACHE_MISSES, nlines);
+        char *lines = (char *) scratch_alloc(nlines * SFS_BLOCK_SIZE);
+        img_raw_read(lines, nlines * SFS_BLOCK_SIZE, cache_line_off(first));
+        size_t in = cache_line_in(offset);
+        size_t n = nlines * SFS_BLOCK_SIZE - in;
+        if (n > size) {n = size;}
+        memcpy(buf, lines + in, n);
+        buf += n; size -= n; offset += n;
+
+        pthread_mutex_lock(&cache_lock);
+        if (gen == cache_gen) {
+            for (size_t i = 0; i < nlines; i++) {
+                if (cache_map[first + i] != NULL) {continue;}
+                memcpy(cache_take(first + i)->data, lines + i * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE);
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+}
+
+static void cache_write(const char *buf, size_t size, off_t offset) {
+    pthread_mutex_lock(&cache_lock);
+    cache_gen++;
+    while (size > 0) {
+        uint32_t line = cache_line_of(offset);
+        size_t in = cache_line_in(offset);
+        size_t n = size < SFS_BLOCK_SIZE - in ? size : SFS_BLOCK_SIZE - in;
+
+        struct cache_line *c = cache_get(line);
+        stats_io(c != NULL ? STATS_CACHE_HITS : STATS_CACHE_MISSES, 1);
+        if (c == NULL) {
+            c = cache_take(line);
+            // a partial write needs the rest of the line
+            if (n < SFS_BLOCK_SIZE) {img_raw_read(c->data, SFS_BLOCK_SIZE, cache_line_off(line));}
+        }
+        memcpy(c->data + in, buf, n);
+        if (!c->dirty) {
+            c->dirty = 1;
+            cache_ndirty++;
+        }
+        buf += n; size -= n; offset += n;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+Function that writes all dirty lines back to the image, each run of dirty
+lines that follow each other as a single write.
+*/
+static void cache_flush(void) {
+    if (cache_lines == NULL) {return;}
+
+    SCRATCH_SCOPE();
+    pthread_mutex_lock(&cache_lock);
+    if (cache_ndirty > 0) {
+        char *runs = (char *) scratch_alloc(cache_ndirty * SFS_BLOCK_SIZE);
+        size_t used = 0;
+        struct img_batch batch;
+        batch_init(&batch, 1);
+        for (uint32_t line = 0; line < CACHE_NLINES; line++) {
+            size_t start = used;
+            uint32_t first = line;
+            struct cache_line *c;
+            while (line < CACHE_NLINES && (c = cache_map[line]) != NULL && c->dirty) {
+                memcpy(runs + used, c->data, SFS_BLOCK_SIZE);
+                c->dirty = 0;
+                used += SFS_BLOCK_SIZE;
+                line++;
+            }
+            if (used > start) {batch_queue(&batch, runs + start, used - start, cache_line_off(first));}
+        }
+        batch_submit(&batch);
+        cache_ndirty = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+Function that runs in the background and flushes the cache every
+options.writeback seconds, until cache_stop is called.
+*/
+static void *cache_writeback(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&cache_lock);
+    while (cache_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += options.writeback;
+        pthread_cond_timedwait(&cache_cond, &cache_lock, &ts);
+        if (!cache_running) {break;}
+
+        pthread_mutex_unlock(&cache_lock);
+        cache_flush();
+        pthread_mutex_lock(&cache_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+}
+
+/*
+Function that sets up the cache if --cache is given (and the image is not
+mapped), together with its writeback thread if --writeback is not 0.
+*/
+static void cache_start(void) {
+    if (options.cache == 0 || img_map != NULL) {return;}
+
+    cache_init(options.cache);
+    if (options.writeback > 0) {
+        cache_running = 1;
+        if (pthread_create(&cache_thread, NULL, cache_writeback, NULL) != 0) {
+            perror("cache: cannot start writeback thread");
+            cache_running = 0;
+        }
+    }
+}
+
+/*
+Function that stops the writeback thread, if it runs.
+*/
+static void cache_stop(void) {
+    if (!cache_running) {return;}
+
+    pthread_mutex_lock(&cache_lock);
+    cache_running = 0;
+    pthread_cond_signal(&cache_cond);
+    pthread_mutex_unlock(&cache_lock);
+    pthread_join(cache_thread, NULL);
+}
+
+static void img_read(void *buf, size_t size, off_t offset) {
+    if (cache_lines != NULL && offset >= (off_t) SFS_ROOTDIR_OFF) {
+        cache_read((char *) buf, size, offset);
+    } else {
+        img_raw_read(buf, size, offset);
+    }
+}
+
+static void img_write(const void *buf, size_t size, off_t offset) {
+    if (cache_lines != NULL && offset >= (off_t) SFS_ROOTDIR_OFF) {
+        cache_write((const char *) buf, size, offset);
+    } else {
+        img_raw_write(buf, size, offset);
+    }
+}
+
+/*
+Function that adds a request to the batch. With the cache the request is done
+right away through the cache instead, which does its own batching of writes.
+*/
+static void batch_add(struct img_batch *b, const void *buf, size_t size, off_t offset) {
+    if (cache_lines != NULL) {
+        if (b->write) {
+            img_write(buf, size, offset);
+        } else {
+            img_read((void *) buf, size, offset);
+        }
+        return;
+    }
+    batch_queue(b, buf, size, offset);
+}
+
+/*
+Function that returns a pointer to the bytes at `offset` in the mapped image,
+or NULL if the image is not mapped (the caller then uses img_read).
+*/
+static void *img_ptr(off_t offset) {
+    return img_map != NULL ? img_map + offset : NULL;
+}
+
+/*
+Function that makes sure everything written so far has reached the image.
+*/
+static void img_flush(void) {
+    cache_flush();
+    if (img_map != NULL) {msync(img_map, img_map_size, MS_SYNC);}
+    if (img_fd >= 0) {fsync(img_fd);}
+}
+
+/*
+ * Locking. FUSE runs the callbacks on several threads at once, so shared state
+ * is protected by locks, from outermost to innermost (a thread only ever
+ * waits for a lock that comes later in this list than the ones it holds):
+ *
+ *  - rename_lock: held by a rename for its whole duration, so only one rename
+ *    at a time holds more than one file lock, and the tree cannot change
+ *    shape under the check that a directory is not moved into itself.
+ *  - file_locks: reader/writer locks, striped by path. Reads of a file hold
+ *    it shared, everything that changes an existing file or directory entry
+ *    (its size, chain or existence) holds it exclusive, and resolves the path
+ *    only after taking it.
+ *  - the lock of each handle, which is held while the handle is resolved
+ *    again (see handle_refresh).
+ *  - dir_locks: reader/writer locks, striped by the first block of a
+ *    directory (SFS_BLOCKIDX_END for the root directory). Lookups hold every
+ *    directory on the path shared while scanning it; adding, removing or
+ *    updating a slot holds its directory exclusive. A thread holding one of
+ *    these exclusive only waits for others with trylock (see dir_lock_all),
+ *    and a stripe may be taken shared more than once by one lookup.
+ *  - alloc_lock: the block table mirror, its dirty state and the allocator.
+ *    Chains themselves are read without it: a chain only changes under the
+ *    file lock of its file.
+ *  - handles_lock and the dcache stripes.
+ *
+ * Parallel reads of different files only share locks in read mode.
+ */
+#define FILE_NLOCKS 256
+#define DIR_NLOCKS 64
+#define DCACHE_NLOCKS 64
+
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t file_locks[FILE_NLOCKS];
+static pthread_rwlock_t dir_locks[DIR_NLOCKS];
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dcache_locks[DCACHE_NLOCKS];
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+static void locks_init_once(void) {
+    for (size_t i = 0; i < FILE_NLOCKS; i++) {pthread_rwlock_init(&file_locks[i], NULL);}
+    for (size_t i = 0; i < DIR_NLOCKS; i++) {pthread_rwlock_init(&dir_locks[i], NULL);}
+    for (size_t i = 0; i < DCACHE_NLOCKS; i++) {pthread_mutex_init(&dcache_locks[i], NULL);}
+}
+
+static void locks_init(void) {pthread_once(&locks_once, locks_init_once);}
+
+static uint32_t path_hash(const char *path) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+    return hash;
+}
+
+static pthread_rwlock_t *file_lock(const char *path) {return &file_locks[path_hash(path) % FILE_NLOCKS];}
+
+static pthread_rwlock_t *dir_lock(blockidx_t dir) {return &dir_locks[dir % DIR_NLOCKS];}
+
+// with the low-level API files are locked by inode (see there) instead of by path
+static fuse_ino_t slot_ino(off_t off) {return (off - SFS_ROOTDIR_OFF) / sizeof(struct sfs_entry) + 2;}
+
+static off_t ino_slot(fuse_ino_t ino) {return SFS_ROOTDIR_OFF + (off_t) (ino - 2) * sizeof(struct sfs_entry);}
+
+/*
+ * Generations of the inodes of the low-level API. A slot that is emptied may
+ * later hold another file (or a directory) under the same inode number, so its
+ * generation is bumped whenever its entry goes away (remove_file, remove_dir,
+ * move_entry) and lookups return it, so the kernel does not take the new file
+ * for the old one.
+ */
+#define SLOT_NINOS ((SFS_DATA_OFF + (size_t) SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE \
+                     - SFS_ROOTDIR_OFF) / sizeof(struct sfs_entry) + 2)
+
+static uint32_t slot_gens[SLOT_NINOS];
+
+static void slot_gen_bump(off_t off) {__atomic_add_fetch(&slot_gens[slot_ino(off)], 1, __ATOMIC_RELAXED);}
+
+static uint32_t slot_gen(off_t off) {return __atomic_load_n(&slot_gens[slot_ino(off)], __ATOMIC_RELAXED);}
+
+static pthread_rwlock_t *ino_lock(fuse_ino_t ino) {return &file_locks[ino % FILE_NLOCKS];}
+
+/*
+Function that returns whether the lock of dirs[i] is that of an earlier one.
+*/
+static int dir_lock_taken(const blockidx_t *dirs, size_t i) {
+    for (size_t j = 0; j < i; j++) {
+        if (dir_lock(dirs[j]) == dir_lock(dirs[i])) {return 1;}
+    }
+    return 0;
+}
+
+/*
+Function that takes the locks of the n directories in dirs exclusively (each
+stripe once). Only the first one is waited for; the others are tried, and if
+one is busy all are released and taken again, so this never waits while
+holding a directory lock. Release with dir_unlock_all.
+*/
+static void dir_lock_all(const blockidx_t *dirs, size_t n) {
+    while (1) {
+        pthread_rwlock_wrlock(dir_lock(dirs[0]));
+        size_t i = 1;
+        while (i < n && (dir_lock_taken(dirs, i) || pthread_rwlock_trywrlock(dir_lock(dirs[i])) == 0)) {
+            i++;
+        }
+        if (i == n) {return;}
+
+        while (--i > 0) {
+            if (!dir_lock_taken(dirs, i)) {pthread_rwlock_unlock(dir_lock(dirs[i]));}
+        }
+        pthread_rwlock_unlock(dir_lock(dirs[0]));
+        sched_yield();
+    }
+}
+
+static void dir_unlock_all(const blockidx_t *dirs, size_t n) {
+    for (size_t i = n; i-- > 0;) {
+        if (!dir_lock_taken(dirs, i)) {pthread_rwlock_unlock(dir_lock(dirs[i]));}
+    }
+}
+
+static void dir_lock_pair(blockidx_t a, blockidx_t b) {
+    blockidx_t dirs[2] = {a, b};
+    dir_lock_all(dirs, 2);
+}
+
+static void dir_unlock_pair(blockidx_t a, blockidx_t b) {
+    blockidx_t dirs[2] = {a, b};
+    dir_unlock_all(dirs, 2);
+}
+
+/*
+ * Scanning kernels for the scans on hot paths: finding a name among the
+ * entries of a directory, together with its first free slot, and finding
+ * values in the block table (all free blocks, as a bitmap, or one value).
+ * Each has a scalar version and, on x86, an SSE2 and an AVX2 version;
+ * scan_init points the scan_* functions at the best ones the CPU supports.
+ * bench.c checks the versions against each other and times them.
+ *
+ * A name is compared a vector at a time: the first 16 or 32 bytes of an entry
+ * against the name padded with zeros, counting only the bytes of the name and
+ * its terminator, so only longer names need a compare of the rest. Entries
+ * are 64 bytes apart, so that is one load per entry, after which a free slot
+ * is a test of its first byte.
+ */
+typedef long (*scan_dir_fn)(const struct sfs_entry *ents, size_t n, const char *name, size_t len,
+                            long *free_slot);
+typedef size_t (*scan_free_fn)(const blockidx_t *tbl, size_t n, uint64_t *map);
+typedef long (*scan_u16_fn)(const uint16_t *a, size_t n, uint16_t v);
+
+/*
+Function that returns the index of the entry named name (of length len) among
+the n entries at ents, or -1, and stores the index of the first free one in
+*free_slot (unless it is NULL), or -1. Scanning stops as soon as both are
+known.
+*/
+static long scan_dir_scalar(const struct sfs_entry *ents, size_t n, const char *name, size_t len,
+                            long *free_slot)
+{
+    long found = -1, slot = -1;
+    for (size_t i = 0; i < n && (found < 0 || (free_slot != NULL && slot < 0)); i++) {
+        const char *f = ents[i].filename;
+        if (f[0] == '\0') {
+            if (slot < 0) {slot = i;}
+        } else if (found < 0 && memcmp(f, name, len + 1) == 0) {
+            found = i;
+        }
+    }
+    if (free_slot != NULL) {*free_slot = slot;}
+    return found;
+}
+
+/*
+Function that sets the bits of the n entries (a multiple of 64) of tbl that
+are SFS_BLOCKIDX_EMPTY in the bitmap map. Returns how many there are.
+*/
+static size_t scan_free_scalar(const blockidx_t *tbl, size_t n, uint64_t *map) {
+    size_t count = 0;
+    for (size_t w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < 64; i++) {
+            bits |= (uint64_t) (tbl[w * 64 + i] == SFS_BLOCKIDX_EMPTY) << i;
+        }
+        map[w] = bits;
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
+
+/*
+Function that returns the index of the first of the n values at a that is v,
+or -1.
+*/
+static long scan_u16_scalar(const uint16_t *a, size_t n, uint16_t v) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] == v) {return i;}
+    }
+    return -1;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static long scan_dir_sse2(const struct sfs_entry *ents, size_t n, const char *name, size_t len,
+                          long *free_slot)
+{
+    char pad[16] = {0};
+    memcpy(pad, name, len < 16 ? len : 16);
+    __m128i want = _mm_loadu_si128((const __m128i *) pad);
+    unsigned need = len >= 15 ? 0xffffu : (1u << (len + 1)) - 1;
+
+    long found = -1, slot = -1;
+    for (size_t i = 0; i < n && (found < 0 || (free_slot != NULL && slot < 0)); i++) {
+        const char *f = ents[i].filename;
+        if (f[0] == '\0') {
+            if (slot < 0) {slot = i;}
+        } else if (found < 0) {
+            __m128i have = _mm_loadu_si128((const __m128i *) f);
+            unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(have, want));
+            if ((eq & need) == need && (len < 16 || memcmp(f + 16, name + 16, len - 15) == 0)) {
+                found = i;
+            }
+        }
+    }
+    if (free_slot != NULL) {*free_slot = slot;}
+    return found;
+}
+
+__attribute__((target("sse2")))
+static size_t scan_free_sse2(const blockidx_t *tbl, size_t n, uint64_t *map) {
+    const __m128i empty = _mm_set1_epi16((short) SFS_BLOCKIDX_EMPTY);
+    size_t count = 0;
+    for (size_t w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < 64; i += 16) {
+            // 16 compares packed into 16 bytes, one mask bit each
+            __m128i a = _mm_loadu_si128((const __m128i *) (tbl + w * 64 + i));
+            __m128i b = _mm_loadu_si128((const __m128i *) (tbl + w * 64 + i + 8));
+            __m128i eq = _mm_packs_epi16(_mm_cmpeq_epi16(a, empty), _mm_cmpeq_epi16(b, empty));
+            bits |= (uint64_t) (unsigned) _mm_movemask_epi8(eq) << i;
+        }
+        map[w] = bits;
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
+
+__attribute__((target("sse2")))
+static long scan_u16_sse2(const uint16_t *a, size_t n, uint16_t v) {
+    const __m128i want = _mm_set1_epi16((short) v);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *) (a + i)), want);
+        unsigned mask = _mm_movemask_epi8(eq);
+        if (mask != 0) {return i + __builtin_ctz(mask) / 2;}
+    }
+    long r = scan_u16_scalar(a + i, n - i, v);
+    return r < 0 ? -1 : (long) i + r;
+}
+
+__attribute__((target("avx2")))
+static long scan_dir_avx2(const struct sfs_entry *ents, size_t n, const char *name, size_t len,
+                          long *free_slot)
+{
+    char pad[32] = {0};
+    memcpy(pad, name, len < 32 ? len : 32);
+    __m256i want = _mm256_loadu_si256((const __m256i *) pad);
+    unsigned need = len >= 31 ? 0xffffffffu : (1u << (len + 1)) - 1;
+
+    long found = -1, slot = -1;
+    for (size_t i = 0; i < n && (found < 0 || (free_slot != NULL && slot < 0)); i++) {
+        const char *f = ents[i].filename;
+        if (f[0] == '\0') {
+            if (slot < 0) {slot = i;}
+        } else if (found < 0) {
+            __m256i have = _mm256_loadu_si256((const __m256i *) f);
+            unsigned eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(have, want));
+            if ((eq & need) == need && (len < 32 || memcmp(f + 32, name + 32, len - 31) == 0)) {
+                found = i;
+            }
+        }
+    }
+    if (free_slot != NULL) {*free_slot = slot;}
+    return found;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_free_avx2(const blockidx_t *tbl, size_t n, uint64_t *map) {
+    const __m256i empty = _mm256_set1_epi16((short) SFS_BLOCKIDX_EMPTY);
+    size_t count = 0;
+    for (size_t w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < 64; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *) (tbl + w * 64 + i));
+            __m256i b = _mm256_loadu_si256((const __m256i *) (tbl + w * 64 + i + 16));
+            __m256i eq = _mm256_packs_epi16(_mm256_cmpeq_epi16(a, empty), _mm256_cmpeq_epi16(b, empty));
+            // packing works per 128-bit lane; put the quarters back in order
+            eq = _mm256_permute4x64_epi64(eq, 0xd8);
+            bits |= (uint64_t) (unsigned) _mm256_movemask_epi8(eq) << i;
+        }
+        map[w] = bits;
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static long scan_u16_avx2(const uint16_t *a, size_t n, uint16_t v) {
+    const __m256i want = _mm256_set1_epi16((short) v);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i eq = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *) (a + i)), want);
+        unsigned mask = _mm256_movemask_epi8(eq);
+        if (mask != 0) {return i + __builtin_ctz(mask) / 2;}
+    }
+    long r = scan_u16_scalar(a + i, n - i, v);
+    return r < 0 ? -1 : (long) i + r;
+}
+#endif
+
+static scan_dir_fn scan_dir_impl = scan_dir_scalar;
+static scan_free_fn scan_free = scan_free_scalar;
+static scan_u16_fn scan_u16 = scan_u16_scalar;
+
+static void scan_init(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_dir_impl = scan_dir_avx2;
+        scan_free = scan_free_avx2;
+        scan_u16 = scan_u16_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_dir_impl = scan_dir_sse2;
+        scan_free = scan_free_sse2;
+        scan_u16 = scan_u16_sse2;
+    }
+#endif
+}
+
+/*
+Function that finds name among the n entries at ents, as the scan_dir kernels
+do; a name too long for an entry is never found.
+*/
+static long scan_dir(const struct sfs_entry *ents, size_t n, const char *name, long *free_slot) {
+    size_t len = strlen(name);
+    if (len >= SFS_FILENAME_MAX) {
+        // still find the free slot
+        if (free_slot != NULL) {scan_dir_impl(ents, n, "", 0, free_slot);}
+        return -1;
+    }
+    return scan_dir_impl(ents, n, name, len, free_slot);
+}
+
+/*
+In-memory mirror of the block table. It is read from disk once at mount (see
+sfs_init) and all chain lookups are served from it. Changes go through
+blocktbl_set, which marks the entry dirty, and blocktbl_flush writes only the
+dirty index ranges back to disk. When the image is mapped, blocktbl points
+at the table in the mapping itself, so there is nothing to load or flush.
+Changing the table (blocktbl_set, alloc_blocks) requires alloc_lock.
+*/
+static blockidx_t blocktbl_mem[SFS_BLOCKTBL_NENTRIES];
+static blockidx_t *blocktbl = blocktbl_mem;
+static uint8_t blocktbl_dirty[SFS_BLOCKTBL_NENTRIES / 8];
+static size_t blocktbl_dirty_lo = SFS_BLOCKTBL_NENTRIES, blocktbl_dirty_hi = 0;
+
+/*
+ * Free-space allocator, built from the block table at mount. It consists of a
+ * bitmap of free blocks and a free-extent index: a segment tree over all
+ * blocks where each node stores the length of the free run at the start
+ * (pref) and end (suf) of its range, and the longest free run inside it
+ * (best). This answers "the first run of n free blocks at or after block X"
+ * in O(log N). The state follows the block table automatically, since
+ * blocktbl_set marks blocks used or free. SFS_BLOCKTBL_NENTRIES must be a
+ * power of two.
+ */
+struct extent_node {
+    uint16_t pref, suf, best;
+};
+
+static uint64_t free_map[SFS_BLOCKTBL_NENTRIES / 64];
+static struct extent_node extent_tree[2 * SFS_BLOCKTBL_NENTRIES];
+static size_t free_blocks = 0;
+
+static void extent_pull(size_t node, size_t len) {
+    struct extent_node *l = &extent_tree[2 * node], *r = &extent_tree[2 * node + 1];
+    struct extent_node *n = &extent_tree[node];
+    size_t half = len / 2;
+    n->pref = l->pref == half ? half + r->pref : l->pref;
+    n->suf = r->suf == half ? half + l->suf : r->suf;
+    n->best = l->best > r->best ? l->best : r->best;
+    if (l->suf + r->pref > n->best) {n->best = l->suf + r->pref;}
+}
+
+static int block_is_free(blockidx_t idx) {
+    return (free_map[idx / 64] >> (idx % 64)) & 1;
+}
+
+static void alloc_mark(blockidx_t idx, int is_free) {
+    if (block_is_free(idx) == is_free) {return;}
+    free_map[idx / 64] ^= (uint64_t)1 << (idx % 64);
+    free_blocks += is_free ? 1 : -1;
+
+    size_t node = SFS_BLOCKTBL_NENTRIES + idx;
+    extent_tree[node].pref = extent_tree[node].suf = extent_tree[node].best = is_free;
+    for (size_t len = 2; node > 1; len *= 2) {
+        node /= 2;
+        extent_pull(node, len);
+    }
+}
+
+static void alloc_build(void) {
+    free_blocks = scan_free(blocktbl, SFS_BLOCKTBL_NENTRIES, free_map);
+    for (size_t i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) {
+        int is_free = block_is_free(i);
+        struct extent_node *leaf = &extent_tree[SFS_BLOCKTBL_NENTRIES + i];
+        leaf->pref = leaf->suf = leaf->best = is_free;
+    }
+    // build the tree bottom-up, level by level
+    for (size_t level = SFS_BLOCKTBL_NENTRIES / 2, len = 2; level >= 1; level /= 2, len *= 2) {
+        for (size_t node = level; node < 2 * level; node++) {
+            extent_pull(node, len);
+        }
+    }
+}
+
+/*
+Function that returns the start of the first run of n free blocks that starts
+at or after block `from`, within the range [lo, hi) of `node`, or -1.
+*/
+static long extent_find(size_t node, size_t lo, size_t hi, size_t from, size_t n) {
+    if (hi <= from || hi - lo < n) {return -1;}
+    struct extent_node *e = &extent_tree[node];
+    if (e->best < n) {return -1;}
+    if (hi - lo == 1) {return lo;}
+
+    size_t mid = (lo + hi) / 2;
+    long r = extent_find(2 * node, lo, mid, from, n);
+    if (r >= 0) {return r;}
+
+    // a run crossing the middle starts in the free suffix of the left half
+    size_t cross = mid - extent_tree[2 * node].suf;
+    if (cross < from) {cross = from;}
+    if (cross < mid && mid - cross + extent_tree[2 * node + 1].pref >= n) {return cross;}
+
+    return extent_find(2 * node + 1, mid, hi, from, n);
+}
+
+static long extent_find_from(size_t n, size_t from) {
+    long r = extent_find(1, 0, SFS_BLOCKTBL_NENTRIES, from, n);
+    if (r < 0 && from > 0) {r = extent_find(1, 0, SFS_BLOCKTBL_NENTRIES, 0, n);}
+    return r;
+}
+
+/*
+Function that allocates n free blocks and stores their indices in out. It
+prefers a single contiguous run that starts at or after `hint` (wrapping
+around to the start of the disk); if no run is long enough it takes the
+longest runs available, so the result is as little fragmented as possible.
+With `contiguous` set only a single run is acceptable.
+The blocks are marked used in the allocator; the caller links them in the
+block table. Returns 0 on success, or -ENOSPC.
+*/
+static int alloc_blocks(size_t n, blockidx_t hint, int contiguous, blockidx_t *out) {
+    if (n > free_blocks) {return -ENOSPC;}
+    if (hint >= SFS_BLOCKTBL_NENTRIES) {hint = 0;}
+
+    long start = extent_find_from(n, hint);
+    if (start < 0 && contiguous) {return -ENOSPC;}
+
+    size_t got = 0;
+    while (got < n) {
+        size_t len = n - got;
+        if (start < 0) {
+            // no run is long enough; take the longest one there is
+            if (extent_tree[1].best < len) {len = extent_tree[1].best;}
+            start = extent_find_from(len, hint);
+        }
+        for (size_t i = 0; i < len; i++) {
+            out[got++] = start + i;
+            alloc_mark(start + i, 0);
+        }
+        hint = start + len;
+        start = -1;
+    }
+    return 0;
+}
+
+/*
+ * Preallocations. fallocate with FALLOC_FL_KEEP_SIZE reserves blocks beyond
+ * the end of a file, which the image cannot express: the length of a chain
+ * always follows from the size of its file. So reserved blocks are only taken
+ * from the allocator (they count as used) and remembered here, by the offset
+ * of the entry of their file, until the file grows into them (grow_chain takes
+ * them first, in order), shrinks, or is removed. At unmount they are simply
+ * free again. The list is protected by alloc_lock.
+ */
+struct prealloc {
+    off_t entry_off;
+    blockidx_t *blocks;
+    size_t n;
+    struct prealloc *next;
+};
+
+static struct prealloc *preallocs = NULL;
+
+static struct prealloc **prealloc_find(off_t entry_off) {
+    struct prealloc **p = &preallocs;
+    while (*p != NULL && (*p)->entry_off != entry_off) {p = &(*p)->next;}
+    return p;
+}
+
+static void prealloc_drop(struct prealloc **p) {
+    struct prealloc *r = *p;
+    *p = r->next;
+    free(r->blocks);
+    free(r);
+}
+
+/*
+Function that makes sure n blocks are reserved for the file whose entry is at
+entry_off, preferably right after block `after` (or after the blocks already
+reserved). Returns 0 on success, or -ENOSPC.
+*/
+static int prealloc_reserve(off_t entry_off, size_t n, blockidx_t after) {
+    struct prealloc **p = prealloc_find(entry_off);
+    if (*p == NULL) {
+        *p = (struct prealloc *) calloc(1, sizeof(struct prealloc));
+        (*p)->entry_off = entry_off;
+    }
+    struct prealloc *r = *p;
+    if (r->n >= n) {return 0;}
+
+    if (r->n > 0) {after = r->blocks[r->n - 1];}
+    r->blocks = (blockidx_t *) realloc(r->blocks, n * sizeof(blockidx_t));
+    int ret = alloc_blocks(n - r->n, after == SFS_BLOCKIDX_END ? 0 : after + 1, 0, r->blocks + r->n);
+    if (ret == 0) {
+        r->n = n;
+    } else if (r->n == 0) {
+        prealloc_drop(p);
+    }
+    return ret;
+}
+
+/*
+Function that moves up to n of the blocks reserved for the file at entry_off
+into out, in order. Returns how many there were.
+*/
+static size_t prealloc_take(off_t entry_off, blockidx_t *out, size_t n) {
+    struct prealloc **p = prealloc_find(entry_off);
+    if (*p == NULL) {return 0;}
+
+    struct prealloc *r = *p;
+    if (n > r->n) {n = r->n;}
+    memcpy(out, r->blocks, n * sizeof(blockidx_t));
+    memmove(r->blocks, r->blocks + n, (r->n - n) * sizeof(blockidx_t));
+    r->n -= n;
+    if (r->n == 0) {prealloc_drop(p);}
+    return n;
+}
+
+/*
+Function that gives the blocks reserved for the file at entry_off back to the
+allocator.
+*/
+static void prealloc_release(off_t entry_off) {
+    struct prealloc **p = prealloc_find(entry_off);
+    if (*p == NULL) {return;}
+
+    for (size_t i = 0; i < (*p)->n; i++) {
+        alloc_mark((*p)->blocks[i], 1);
+    }
+    prealloc_drop(p);
+}
+
+/*
+Function that moves the reservation of the file at entry_off along with its
+entry, to new_off.
+*/
+static void prealloc_move(off_t entry_off, off_t new_off) {
+    struct prealloc **p = prealloc_find(entry_off);
+    if (*p != NULL) {(*p)->entry_off = new_off;}
+}
+
+/*
+ * Unwritten blocks. Growing a file (by truncate, or by a write past its end)
+ * only links new blocks into its chain, without writing them: such a block is
+ * marked unwritten until data is first written to it, and until then reads of
+ * it return zeros without any disk I/O. A write that covers only part of an
+ * unwritten block fills the rest of it with zeros. The marks only live in
+ * memory; blocks that are still unwritten at unmount are zeroed on disk then
+ * (unwritten_materialize), so after a crash they may show old data instead.
+ * The mark of a block only changes under the file lock of its file, or when
+ * the block is freed, so readers of the file see a stable mark. The words are
+ * updated atomically, since one covers blocks of many files.
+ */
+static uint64_t unwritten_map[SFS_BLOCKTBL_NENTRIES / 64];
+
+static int block_unwritten(blockidx_t idx) {
+    return (__atomic_load_n(&unwritten_map[idx / 64], __ATOMIC_RELAXED) >> (idx % 64)) & 1;
+}
+
+static void mark_unwritten(blockidx_t idx, int unwritten) {
+    uint64_t bit = (uint64_t)1 << (idx % 64);
+    if (unwritten) {
+        __atomic_fetch_or(&unwritten_map[idx / 64], bit, __ATOMIC_RELAXED);
+    } else if (__atomic_load_n(&unwritten_map[idx / 64], __ATOMIC_RELAXED) & bit) {
+        __atomic_fetch_and(&unwritten_map[idx / 64], ~bit, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+Function that writes zeros over every block that is still unwritten, so that
+the image holds what reads of them returned, and clears the marks. Runs of
+consecutive blocks are written together, in one batch.
+*/
+static void unwritten_materialize(void) {
+    static const char zeros[64 * SFS_BLOCK_SIZE];
+    struct img_batch batch;
+    batch_init(&batch, 1);
+    size_t i = 0;
+    while (i < SFS_BLOCKTBL_NENTRIES) {
+        if (!block_unwritten(i)) {i++; continue;}
+
+        size_t n = 1;
+        while (i + n < SFS_BLOCKTBL_NENTRIES && n < 64 && block_unwritten(i + n)) {n++;}
+        batch_add(&batch, zeros, n * SFS_BLOCK_SIZE, SFS_DATA_OFF + i * SFS_BLOCK_SIZE);
+        for (size_t k = 0; k < n; k++) {
+            mark_unwritten(i + k, 0);
+        }
+        i += n;
+    }
+    batch_submit(&batch);
+}
+
+static void blocktbl_load(void) {
+    blockidx_t *mapped = (blockidx_t *) img_ptr(SFS_BLOCKTBL_OFF);
+    if (mapped != NULL) {
+        blocktbl = mapped;
+    } else {
+        img_read(blocktbl, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+    }
+    alloc_build();
+}
+
+static void blocktbl_set(blockidx_t idx, blockidx_t next) {
+    alloc_mark(idx, next == SFS_BLOCKIDX_EMPTY);
+    if (next == SFS_BLOCKIDX_EMPTY) {mark_unwritten(idx, 0);}
+    blocktbl[idx] = next;
+    blocktbl_dirty[idx / 8] |= 1 << (idx % 8);
+    if (idx < blocktbl_dirty_lo) {blocktbl_dirty_lo = idx;}
+    if (idx >= blocktbl_dirty_hi) {blocktbl_dirty_hi = idx + 1;}
+}
+
+/*
+Function that adds a write of every run of consecutive dirty entries to the
+batch b, and clears the dirty state. The batch points into the table, so if
+another thread changes those entries before it is submitted, the newer
+values are written (and that thread writes them again itself).
+*/
+static void blocktbl_flush_batch(struct img_batch *b) {
+    pthread_mutex_lock(&alloc_lock);
+    if (blocktbl != blocktbl_mem) {
+        // changes went straight into the mapped table
+        memset(blocktbl_dirty, 0, sizeof(blocktbl_dirty));
+        blocktbl_dirty_lo = SFS_BLOCKTBL_NENTRIES;
+        blocktbl_dirty_hi = 0;
+        pthread_mutex_unlock(&alloc_lock);
+        return;
+    }
+
+    size_t i = blocktbl_dirty_lo;
+    while (i < blocktbl_dirty_hi) {
+        if (!(blocktbl_dirty[i / 8] & (1 << (i % 8)))) {i++; continue;}
+
+        size_t start = i;
+        while (i < blocktbl_dirty_hi && (blocktbl_dirty[i / 8] & (1 << (i % 8)))) {
+            blocktbl_dirty[i / 8] &= ~(1 << (i % 8));
+            i++;
+        }
+        batch_add(b, blocktbl + start, (i - start) * sizeof(blockidx_t),
+                  SFS_BLOCKTBL_OFF + start * sizeof(blockidx_t));
+    }
+    blocktbl_dirty_lo = SFS_BLOCKTBL_NENTRIES;
+    blocktbl_dirty_hi = 0;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+Function that writes every run of consecutive dirty entries back to disk with
+a single write each.
+*/
+static void blocktbl_flush(void) {
+    struct img_batch batch;
+    batch_init(&batch, 1);
+    blocktbl_flush_batch(&batch);
+    batch_submit(&batch);
+}
+
+/*
+Function that reads in all directory entries from a certain directory
+Argument is pointer to the array of sfs_entry that needs to be filled,
+second argument is first block of the directory
+*/
+static void load_dir(struct sfs_entry *dir, blockidx_t firstblock) {
+    struct img_batch batch;
+    batch_init(&batch, 0);
+    // first block
+    batch_add(&batch, dir, SFS_BLOCK_SIZE, SFS_DATA_OFF + firstblock * SFS_BLOCK_SIZE);
+    // second block
+    blockidx_t next = blocktbl[firstblock];
+    batch_add(&batch, dir+SFS_BLOCK_SIZE/sizeof(struct sfs_entry), SFS_BLOCK_SIZE, SFS_DATA_OFF + next * SFS_BLOCK_SIZE);
+    batch_submit(&batch);
+    return;
+}
+
+/*
+Function that returns the entries of the directory at firstblock straight from
+the mapped image, or NULL if the image is not mapped or the two blocks of the
+directory are not consecutive (the caller then uses load_dir).
+*/
+static struct sfs_entry *mapped_dir(blockidx_t firstblock) {
+    if (blocktbl[firstblock] != firstblock + 1) {return NULL;}
+    return (struct sfs_entry *) img_ptr(SFS_DATA_OFF + firstblock * SFS_BLOCK_SIZE);
+}
+
+/*
+Function that returns how many of the n blocks in `blocks` form a run of
+physically consecutive blocks (blocktbl[i] == i+1) starting at blocks[0].
+Such a run can be transferred with a single disk_read or disk_write.
+*/
+static size_t chain_run(const blockidx_t *blocks, size_t n) {
+    size_t run = 1;
+    while (run < n && blocks[run] == blocks[run-1] + 1) {run++;}
+    return run;
+}
+
+/*
+Function that reads `size` bytes into buf from the blocks in the array
+`blocks`, starting `in_block` bytes into blocks[0]. Every run of physically
+consecutive blocks is read with one disk_read, and all of those reads are
+submitted as one batch. Unwritten blocks are not read but filled with zeros.
+*/
+static void read_chain(char *buf, const blockidx_t *blocks, size_t size, size_t in_block) {
+    struct img_batch batch;
+    batch_init(&batch, 0);
+    size_t done = 0;
+    size_t i = 0;
+    while (done < size) {
+        // Read (part of) this run of blocks from the data
+        size_t nblocks = (in_block + size - done + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+        size_t run = chain_run(blocks + i, nblocks);
+        int unwritten = block_unwritten(blocks[i]);
+        size_t same = 1;
+        while (same < run && block_unwritten(blocks[i + same]) == unwritten) {same++;}
+        run = same;
+        size_t chunk = run * SFS_BLOCK_SIZE - in_block;
+        if (chunk > size - done) {chunk = size - done;}
+        if (unwritten) {
+            memset(buf + done, 0, chunk);
+        } else {
+            batch_add(
+                &batch,
+                buf + done,
+                chunk,
+                SFS_DATA_OFF + blocks[i] * SFS_BLOCK_SIZE + in_block
+            );
+        }
+        done += chunk;
+        i += run;
+        in_block = 0;
+    }
+    batch_submit(&batch);
+}
+
+/*
+Function that reads `size` bytes starting at byte `offset` of the file whose
+chain starts at firstblock. The chain is only followed up to the last block
+overlapping [offset, offset+size), and only those blocks are read, each
+straight into buf. The caller makes sure the range lies within the file.
+*/
+static void read_file(char *buf, blockidx_t firstblock, size_t size, off_t offset) {
+    blockidx_t curr = firstblock;
+
+    // skip the blocks before offset
+    for (off_t i = 0; i < offset / SFS_BLOCK_SIZE; i++) {
+        curr = blocktbl[curr];
+    }
+
+    // collect the blocks covering the range
+    size_t in_block = offset % SFS_BLOCK_SIZE;
+    size_t nblocks = (in_block + size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+    blockidx_t blocks[nblocks];
+    for (size_t i = 0; i < nblocks; i++) {
+        blocks[i] = curr;
+        curr = blocktbl[curr];
+    }
+
+    read_chain(buf, blocks, size, in_block);
+}
+
+/*
+Function that seperates the last part of a path and returns the parent path
+*/
+static void get_parent(const char *path, char *parent_path) {
+    strcpy(parent_path, path);
+    char* child = strrchr(parent_path, '/');
+    child[0] = '\0';
+    return;
+}
+
+/*
+Function that seperates the last part of a path and returns the child name*/
+static void get_child(const char *path, char **newdir) {
+    const char delim = '/';
+    *newdir = strrchr(path, delim) + 1;
+    return;
+}
+
+/*
+Function to check if the file or directory at path is in the root directory*/
+static int in_root(const char *path) {
+    int count = 0;
+    for (size_t i = 0; i < strlen(path); i++)
+    {
+        if (path[i] == '/') {count++;}
+    }
+    if (count == 1) {return 1;} else {return 0;}
+}
+
+
+
+/*
+ * Path lookup (dentry) cache in front of get_entry. It is a direct-mapped hash
+ * table from path to the result of the lookup: the entry, its slot and the
+ * blockidx of the parent directory, or a negative result for paths that do
+ * not exist. Every operation that adds, removes or changes an entry must call
+ * dcache_forget for its path, while holding the lock of its directory, to
+ * keep the cache coherent; lookups insert while still holding it shared.
+ * Paths are stored in the slots themselves, so caching never allocates; a
+ * path too long for a slot is simply not cached. An empty path marks a free
+ * slot.
+ */
+#define DCACHE_NSLOTS 2048
+#define DCACHE_PATH_MAX 256
+
+struct dcache_slot {
+    char path[DCACHE_PATH_MAX];
+    int result;
+    struct sfs_entry entry;
+    unsigned entry_off;
+    blockidx_t parent_blockidx;
+};
+
+static struct dcache_slot dcache[DCACHE_NSLOTS];
+
+static size_t dcache_index(const char *path) {return path_hash(path) % DCACHE_NSLOTS;}
+
+static void dcache_insert(const char *path, int result, const struct sfs_entry *entry,
+                          unsigned entry_off, blockidx_t parent_blockidx) {
+    size_t len = strlen(path);
+    if (len >= DCACHE_PATH_MAX) {return;}
+    size_t i = dcache_index(path);
+    struct dcache_slot *slot = &dcache[i];
+    pthread_mutex_lock(&dcache_locks[i % DCACHE_NLOCKS]);
+    memcpy(slot->path, path, len + 1);
+    slot->result = result;
+    if (result == 0) {
+        slot->entry = *entry;
+        slot->entry_off = entry_off;
+        slot->parent_blockidx = parent_blockidx;
+    }
+    pthread_mutex_unlock(&dcache_locks[i % DCACHE_NLOCKS]);
+}
+
+static void dcache_forget(const char *path) {
+    if (path == NULL) {return;} // the low-level API does not use the cache
+    size_t i = dcache_index(path);
+    struct dcache_slot *slot = &dcache[i];
+    pthread_mutex_lock(&dcache_locks[i % DCACHE_NLOCKS]);
+    if (strcmp(slot->path, path) == 0) {slot->path[0] = '\0';}
+    pthread_mutex_unlock(&dcache_locks[i % DCACHE_NLOCKS]);
+}
+
+/*
+Function that empties the cache, for when a directory moves and with it every
+path below it.
+*/
+static void dcache_clear(void) {
+    for (size_t i = 0; i < DCACHE_NSLOTS; i++) {
+        pthread_mutex_lock(&dcache_locks[i % DCACHE_NLOCKS]);
+        dcache[i].path[0] = '\0';
+        pthread_mutex_unlock(&dcache_locks[i % DCACHE_NLOCKS]);
+    }
+}
+
+/*
+Function that looks path up in the cache. Returns 1 and fills in the result of
+the lookup on a hit, or 0 on a miss.
+*/
+static int dcache_lookup(const char *path, int *result, struct sfs_entry *entry,
+                         unsigned *entry_off, blockidx_t *parent_blockidx) {
+    size_t i = dcache_index(path);
+    struct dcache_slot *slot = &dcache[i];
+    int hit = 0;
+    pthread_mutex_lock(&dcache_locks[i % DCACHE_NLOCKS]);
+    if (slot->path[0] != '\0' && strcmp(slot->path, path) == 0) {
+        hit = 1;
+        *result = slot->result;
+        if (slot->result == 0) {
+            *entry = slot->entry;
+            *entry_off = slot->entry_off;
+            *parent_blockidx = slot->parent_blockidx;
+        }
+    }
+    pthread_mutex_unlock(&dcache_locks[i % DCACHE_NLOCKS]);
+    return hit;
+}
+
+/*
+Function that returns the offset on disk of entry number `slot` of directory
+dir (SFS_BLOCKIDX_END for the root directory). The second half of a
+subdirectory is found through the block table.
+*/
+static off_t dir_slot_off(blockidx_t dir, size_t slot) {
+    if (dir == SFS_BLOCKIDX_END) {
+        return SFS_ROOTDIR_OFF + slot * sizeof(struct sfs_entry);
+    }
+    size_t per_block = SFS_BLOCK_SIZE / sizeof(struct sfs_entry);
+    blockidx_t block = slot < per_block ? dir : blocktbl[dir];
+    return SFS_DATA_OFF + block * SFS_BLOCK_SIZE + (slot % per_block) * sizeof(struct sfs_entry);
+}
+
+/*
+Function that reads the entries of directory dir into buf (which must hold
+SFS_ROOTDIR_SIZE bytes), or returns them straight from the mapped image.
+The number of entries is stored in nentries.
+*/
+static struct sfs_entry *read_dir(blockidx_t dir, struct sfs_entry *buf, size_t *nentries) {
+    if (dir == SFS_BLOCKIDX_END) {
+        *nentries = SFS_ROOTDIR_NENTRIES;
+        struct sfs_entry *root = (struct sfs_entry *) img_ptr(SFS_ROOTDIR_OFF);
+        if (root != NULL) {return root;}
+        img_read(buf, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+        return buf;
+    }
+    *nentries = SFS_DIR_NENTRIES;
+    struct sfs_entry *mapped = mapped_dir(dir);
+    if (mapped != NULL) {return mapped;}
+    load_dir(buf, dir);
+    return buf;
+}
+
+/*
+ * Name index of the directories. For every directory that has been looked
+ * into, a hash table maps the names in it to their slots, and a bitmap holds
+ * its free slots, so finding a name, or checking that it is not there and
+ * taking a free slot for it, costs a hash and a read of the one entry that
+ * matches instead of a read and a scan of the whole directory. Only the
+ * hashes of the names are kept, so a match is confirmed against its entry.
+ * An index is built from the directory the first time it is needed
+ * (dir_index) and from then on kept up to date by whatever fills or empties
+ * a slot (dir_add, the remove functions and move_entry, through
+ * dir_index_set); it is dropped when its directory is removed. Directories
+ * are known by their first block, as for dir_lock, which works since they
+ * never move. The index of a directory is read under the lock of that
+ * directory, and changed under it exclusively. It may be built under a
+ * shared lock, by several threads at once, so it is published with a
+ * compare-and-swap and the losers throw theirs away.
+ * When there is no memory for an index, the directory is simply scanned.
+ */
+#define INDEX_NBUCKETS 64u // a power of two
+
+struct dir_index {
+    uint64_t free;                       // a bit per free slot
+    uint32_t hash[SFS_ROOTDIR_NENTRIES];
+    int8_t next[SFS_ROOTDIR_NENTRIES];   // the slots of a bucket, up to -1
+    int8_t head[INDEX_NBUCKETS];
+};
+
+static struct dir_index *dir_indexes[SFS_BLOCKTBL_NENTRIES + 1];
+
+static struct dir_index **index_ref(blockidx_t dir) {
+    return &dir_indexes[dir == SFS_BLOCKIDX_END ? SFS_BLOCKTBL_NENTRIES : dir];
+}
+
+static uint64_t all_slots(size_t nentries) {
+    return nentries < 64 ? ((uint64_t) 1 << nentries) - 1 : ~(uint64_t) 0;
+}
+
+/*
+Function that hashes a file name, which on disk need not end in a 0 when it
+fills the whole entry.
+*/
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < SFS_FILENAME_MAX && name[i] != '\0'; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+Function that records in index x that slot now holds name, or is free if
+name is empty.
+*/
+static void index_set(struct dir_index *x, size_t slot, const char *name) {
+    uint64_t bit = (uint64_t) 1 << slot;
+    if (!(x->free & bit)) {
+        // take the slot out of its bucket
+        int8_t *p = &x->head[x->hash[slot] % INDEX_NBUCKETS];
+        while (*p != (int8_t) slot) {p = &x->next[(size_t) *p];}
+        *p = x->next[slot];
+    }
+    if (name[0] == '\0') {
+        x->free |= bit;
+        return;
+    }
+    x->free &= ~bit;
+    x->hash[slot] = name_hash(name);
+    int8_t *head = &x->head[x->hash[slot] % INDEX_NBUCKETS];
+    x->next[slot] = *head;
+    *head = slot;
+}
+
+/*
+Function that returns the index of the locked directory dir, building it if
+there is none yet, or NULL if there is no memory for it.
+*/
+static struct dir_index *dir_index(blockidx_t dir) {
+    struct dir_index **ref = index_ref(dir);
+    struct dir_index *x = __atomic_load_n(ref, __ATOMIC_ACQUIRE);
+    if (x != NULL) {return x;}
+
+    x = (struct dir_index *) malloc(sizeof(struct dir_index));
+    if (x == NULL) {return NULL;}
+    struct sfs_entry buf[SFS_ROOTDIR_NENTRIES];
+    size_t nentries;
+    struct sfs_entry *ents = read_dir(dir, buf, &nentries);
+    // every slot starts out free, and those beyond the directory never are
+    x->free = all_slots(nentries);
+    memset(x->head, -1, sizeof(x->head));
+    for (size_t i = 0; i < nentries; i++) {index_set(x, i, ents[i].filename);}
+
+    struct dir_index *none = NULL;
+    if (!__atomic_compare_exchange_n(ref, &none, x, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(x);
+        return none;
+    }
+    return x;
+}
+
+/*
+Function that records in the index of the directory dir, which is locked
+exclusively, that the slot at offset off on disk now holds name ("" when it
+was emptied). Without an index there is nothing to do.
+*/
+static void dir_index_set(blockidx_t dir, off_t off, const char *name) {
+    struct dir_index *x = __atomic_load_n(index_ref(dir), __ATOMIC_ACQUIRE);
+    if (x == NULL) {return;}
+    size_t slot;
+    if (dir == SFS_BLOCKIDX_END) {
+        slot = (off - SFS_ROOTDIR_OFF) / sizeof(struct sfs_entry);
+    } else {
+        off_t rel = off - SFS_DATA_OFF;
+        slot = (rel % SFS_BLOCK_SIZE) / sizeof(struct sfs_entry);
+        if (rel / SFS_BLOCK_SIZE != dir) {slot += SFS_BLOCK_SIZE / sizeof(struct sfs_entry);}
+    }
+    index_set(x, slot, name);
+}
+
+/*
+Function that drops the index of the directory dir, which is being removed
+and is locked exclusively.
+*/
+static void dir_index_drop(blockidx_t dir) {
+    struct dir_index **ref = index_ref(dir);
+    struct dir_index *x = __atomic_exchange_n(ref, NULL, __ATOMIC_ACQ_REL);
+    free(x);
+}
+
+static void dir_index_drop_all(void) {
+    for (size_t i = 0; i <= SFS_BLOCKTBL_NENTRIES; i++) {
+        free(dir_indexes[i]);
+        dir_indexes[i] = NULL;
+    }
+}
+
+/*
+Function that looks name up in the locked directory dir. Returns its slot and
+stores its entry in ret_entry, or returns -1. The first free slot is stored
+in free_slot (unless it is NULL), or -1 if the directory is full.
+*/
+static long dir_lookup(blockidx_t dir, const char *name, struct sfs_entry *ret_entry,
+                       long *free_slot)
+{
+    struct dir_index *x = dir_index(dir);
+    if (x == NULL) {
+        struct sfs_entry buf[SFS_ROOTDIR_NENTRIES];
+        size_t nentries;
+        struct sfs_entry *ents = read_dir(dir, buf, &nentries);
+        long i = scan_dir(ents, nentries, name, free_slot);
+        if (i >= 0) {*ret_entry = ents[i];}
+        return i;
+    }
+
+    if (free_slot != NULL) {*free_slot = x->free != 0 ? __builtin_ctzll(x->free) : -1;}
+    if (strlen(name) >= SFS_FILENAME_MAX) {return -1;}
+    uint32_t hash = name_hash(name);
+    for (int8_t i = x->head[hash % INDEX_NBUCKETS]; i >= 0; i = x->next[(size_t) i]) {
+        if (x->hash[(size_t) i] != hash) {continue;}
+        img_read(ret_entry, sizeof(struct sfs_entry), dir_slot_off(dir, i));
+        if (strncmp(ret_entry->filename, name, SFS_FILENAME_MAX) == 0) {return i;}
+    }
+    return -1;
+}
+
+/*
+Function that returns whether the locked directory dir has no entries.
+*/
+static int dir_empty(blockidx_t dir) {
+    struct dir_index *x = dir_index(dir);
+    size_t nentries = dir == SFS_BLOCKIDX_END ? SFS_ROOTDIR_NENTRIES : SFS_DIR_NENTRIES;
+    if (x != NULL) {return x->free == all_slots(nentries);}
+
+    struct sfs_entry buf[SFS_ROOTDIR_NENTRIES];
+    struct sfs_entry *ents = read_dir(dir, buf, &nentries);
+    for (size_t i = 0; i < nentries; i++) {
+        if (ents[i].filename[0] != '\0') {return 0;}
+    }
+    return 1;
+}
+
+/*
+ * This is a helper function that is optional, but highly recomended you
+ * implement and use. Given a path, it looks it up on disk. It will return 0 on
+ * success, and a non-zero value on error (e.g., the file did not exist).
+ * The resulting directory entry is placed in the memory pointed to by
+ * ret_entry. Additionally it can return the offset of that direntry on disk in
+ * ret_entry_off, which you can use to update the entry and write it back to
+ * disk (e.g., rmdir, unlink, truncate, write).
+ *
+ * You can start with implementing this function to work just for paths in the
+ * root entry, and later modify it to also work for paths with subdirectories.
+ * This way, all of your other functions can use this helper and will
+ * automatically support subdirectories. To make this function support
+ * subdirectories, we recommend you refactor this function to be recursive, and
+ * take the current directory as argument as well. For example:
+ *
+ *  static int get_entry_rec(const char *path, const struct sfs_entry *parent,
+ *                           size_t parent_nentries, blockidx_t parent_blockidx,
+ *                           struct sfs_entry *ret_entry,
+ *                           unsigned *ret_entry_off)
+ *
+ * Here parent is the directory it is currently searching (at first the rootdir,
+ * later the subdir). The parent_nentries tells the function how many entries
+ * there are in the directory (SFS_ROOTDIR_NENTRIES or SFS_DIR_NENTRIES).
+ * Finally, the parent_blockidx contains the blockidx of the given directory on
+ * the disk, which will help in calculating ret_entry_off.
+ */
+
+/*
+ * Here the directory dir is locked shared by the caller, and so is every
+ * directory this recurses into while it is searched. The result is put in the
+ * path cache (under path) before those locks are dropped. saveptr is the state
+ * of strtok_r, which has to be used since several threads look paths up.
+ */
+static int get_entry_rec(const char *path, blockidx_t dir,
+                           blockidx_t *parent_blockidx,
+                           char *token, char **saveptr,
+                           struct sfs_entry *ret_entry,
+                           unsigned *ret_entry_off) 
+{
+    struct sfs_entry ent;
+    long i = dir_lookup(dir, token, &ent, NULL);
+    if (i < 0) {
+        dcache_insert(path, -ENOENT, NULL, 0, 0);
+        return -ENOENT;
+    }
+
+    token = strtok_r(NULL, "/", saveptr);
+    if (token == NULL) {
+        // We have reached end of path
+        *ret_entry = ent;
+        *ret_entry_off = i;
+        *parent_blockidx = dir;
+        dcache_insert(path, 0, ret_entry, *ret_entry_off, *parent_blockidx);
+        return 0;
+    } else if (!(ent.size & SFS_DIRECTORY)) {
+        return -ENOTDIR;
+    }
+
+    // go on in the next dir
+    pthread_rwlock_rdlock(dir_lock(ent.first_block));
+    int r = get_entry_rec(path, ent.first_block, parent_blockidx, token, saveptr, ret_entry, ret_entry_off);
+    pthread_rwlock_unlock(dir_lock(ent.first_block));
+    return r;
+}
+
+static int get_entry(const char *path, struct sfs_entry *ret_entry,
+                     unsigned *ret_entry_off, blockidx_t *parent_blockidx)
+{
+    int cached;
+    if (dcache_lookup(path, &cached, ret_entry, ret_entry_off, parent_blockidx)) {
+        return cached;
+    }
+
+    /* Get the next component of the path. Make sure to not modify path if it is
+     * the value passed by libfuse (i.e., make a copy). Note that strtok
+     * modifies the string you pass it. */
+
+    /* Look every part of the path up in the name index of its directory. If
+     * it is the last part of the path, return it. If there are more parts
+     * remaining, recurse to handle that subdirectory. */
+
+
+    SCRATCH_SCOPE();
+    size_t pathlen = strlen(path) + 1;
+    char *pathc = (char*) scratch_alloc(pathlen);
+    memcpy(pathc, path, pathlen);
+    char *saveptr;
+    char *token = strtok_r(pathc, "/", &saveptr);
+
+    pthread_rwlock_rdlock(dir_lock(SFS_BLOCKIDX_END));
+    int r = get_entry_rec(path, SFS_BLOCKIDX_END, parent_blockidx, token, &saveptr, ret_entry, ret_entry_off);
+    pthread_rwlock_unlock(dir_lock(SFS_BLOCKIDX_END));
+    return r;
+}
+
+/*
+Function that returns the directory (as used by dir_lock) holding the entry
+that get_entry found for path.
+*/
+static blockidx_t entry_dir(const char *path, blockidx_t parent_blockidx) {
+    return in_root(path) == 1 ? SFS_BLOCKIDX_END : parent_blockidx;
+}
+
+/*
+Function that returns the directory (as used by dir_lock) holding the slot at
+offset `off` on disk. For a slot in the second block of a subdirectory, the
+first block is the one that links to it, which is nearly always the block
+before it.
+*/
+static blockidx_t slot_dir(off_t off) {
+    if (off < (off_t) SFS_BLOCKTBL_OFF) {return SFS_BLOCKIDX_END;}
+    blockidx_t block = (off - SFS_DATA_OFF) / SFS_BLOCK_SIZE;
+    if (blocktbl[block] != SFS_BLOCKIDX_END) {return block;}
+    if (block > 0 && blocktbl[block - 1] == block) {return block - 1;}
+    long i = scan_u16(blocktbl, SFS_BLOCKTBL_NENTRIES, block);
+    return i >= 0 ? (blockidx_t) i : block;
+}
+
+/*
+Function that turns the location returned by get_entry into the offset of
+that entry on disk, so it can be written back.
+*/
+static off_t entry_disk_off(const char *path, unsigned entry_off, blockidx_t parent_blockidx) {
+    return dir_slot_off(entry_dir(path, parent_blockidx), entry_off);
+}
+
+/*
+Function that writes `ent` to its slot at ent_off in directory dir, under the
+exclusive lock of that directory, and forgets path in the path cache.
+*/
+static void write_entry(const char *path, blockidx_t dir, const struct sfs_entry *ent, off_t ent_off) {
+    pthread_rwlock_wrlock(dir_lock(dir));
+    img_write(ent, sizeof(struct sfs_entry), ent_off);
+    dcache_forget(path);
+    pthread_rwlock_unlock(dir_lock(dir));
+}
+
+/*
+ * The parent directory of a path that is about to be changed: its first block
+ * (SFS_BLOCKIDX_END for the root directory) and, for a subdirectory, its own
+ * entry and where that lives, so that dir_lock_parent can check it still
+ * exists once it is locked.
+ */
+struct sfs_parent {
+    blockidx_t dir;
+    struct sfs_entry entry;
+    off_t entry_off;
+};
+
+/*
+Function that resolves the parent directory of path. Returns 0 on success,
+-ENOENT if it does not exist or -ENOTDIR if it is not a directory.
+*/
+static int get_parent_dir(const char *path, struct sfs_parent *p) {
+    if (in_root(path) == 1) {
+        p->dir = SFS_BLOCKIDX_END;
+        return 0;
+    }
+
+    char parent_path[strlen(path) + 1];
+    get_parent(path, parent_path);
+    unsigned int entry_off;
+    blockidx_t parent_blockidx;
+    int r = get_entry(parent_path, &p->entry, &entry_off, &parent_blockidx);
+    if (r != 0) {return r;}
+    if (!(p->entry.size & SFS_DIRECTORY)) {return -ENOTDIR;}
+
+    p->dir = p->entry.first_block;
+    p->entry_off = entry_disk_off(parent_path, entry_off, parent_blockidx);
+    return 0;
+}
+
+/*
+Function that checks that the locked parent directory p still exists.
+Returns 0 if it does, or -ENOENT.
+*/
+static int dir_check_parent(const struct sfs_parent *p) {
+    if (p->dir == SFS_BLOCKIDX_END) {return 0;}
+
+    struct sfs_entry now;
+    img_read(&now, sizeof(struct sfs_entry), p->entry_off);
+    return memcmp(&now, &p->entry, sizeof(struct sfs_entry)) == 0 ? 0 : -ENOENT;
+}
+
+/*
+Function that locks the parent directory p, exclusively if `write` is set,
+and checks that it was not removed in the meantime (rmdir holds the lock of
+the directory it removes, so it cannot happen while this lock is held).
+Returns 0 with the lock held, or -ENOENT without it.
+*/
+static int dir_lock_parent(const struct sfs_parent *p, int write) {
+    if (write) {
+        pthread_rwlock_wrlock(dir_lock(p->dir));
+    } else {
+        pthread_rwlock_rdlock(dir_lock(p->dir));
+    }
+    int r = dir_check_parent(p);
+    if (r != 0) {pthread_rwlock_unlock(dir_lock(p->dir));}
+    return r;
+}
+
+/*
+ * Usage counters for statfs: the number of entries in use, and the number of
+ * subdirectories, which sets how many entry slots there are. They are counted
+ * once at mount (count_entries) and then kept up to date by dir_add and the
+ * remove functions, so statfs never has to scan anything. Free blocks are
+ * counted by the allocator.
+ */
+static size_t used_entries = 0;
+static size_t used_dirs = 0;
+
+/*
+Function that adds delta (1 or -1) to the counters for the entry ent.
+*/
+static void count_entry(const struct sfs_entry *ent, int delta) {
+    __atomic_add_fetch(&used_entries, delta, __ATOMIC_RELAXED);
+    if (ent->size & SFS_DIRECTORY) {__atomic_add_fetch(&used_dirs, delta, __ATOMIC_RELAXED);}
+}
+
+/*
+Function that counts all entries in directory dir and the directories below it.
+*/
+static void count_entries(blockidx_t dir) {
+    struct sfs_entry buf[SFS_ROOTDIR_NENTRIES];
+    size_t nentries;
+    struct sfs_entry *ents = read_dir(dir, buf, &nentries);
+    for (size_t i = 0; i < nentries; i++) {
+        if (strlen(ents[i].filename) == 0) {continue;}
+        count_entry(&ents[i], 1);
+        if (ents[i].size & SFS_DIRECTORY) {count_entries(ents[i].first_block);}
+    }
+}
+
+/*
+Function that adds `ent` as path to the locked parent directory p, with a
+single write of the slot it takes, whose offset is stored in ret_off (unless
+it is NULL). Returns 0 on success, -EEXIST if the name is taken, or -ENOSPC if
+the directory is full.
+*/
+static int dir_add(const char *path, const struct sfs_parent *p, const struct sfs_entry *ent,
+                   off_t *ret_off) {
+    struct sfs_entry old;
+    long slot;
+    if (dir_lookup(p->dir, ent->filename, &old, &slot) >= 0) {return -EEXIST;}
+    if (slot < 0) {return -ENOSPC;} // no more entries
+
+    off_t off = dir_slot_off(p->dir, slot);
+    img_write(ent, sizeof(struct sfs_entry), off);
+    dir_index_set(p->dir, off, ent->filename);
+    dcache_forget(path);
+    count_entry(ent, 1);
+    if (ret_off != NULL) {*ret_off = off;}
+    return 0;
+}
+
+/*
+Function that looks up `name` in the locked directory dir. Returns the offset
+of its entry on disk and stores the entry in ret_entry, or returns -1.
+*/
+static off_t dir_find(blockidx_t dir, const char *name, struct sfs_entry *ret_entry) {
+    long i = dir_lookup(dir, name, ret_entry, NULL);
+    return i < 0 ? -1 : dir_slot_off(dir, i);
+}
+
+
+/*
+ * State of an open file, stored in fi->fh from open (or create) until release.
+ * It holds the resolved entry, where that entry lives on disk and the chain of
+ * the file as an array, so any offset maps to its block with one lookup.
+ * All handles are kept in a list so that operations which change a chain (or
+ * remove the file) can invalidate them; an invalid handle is resolved again
+ * from its path on next use (or, for handles of the low-level API, which have
+ * no path, from the slot of the entry). The fields are used under the file
+ * lock of the file, and the lock of the handle serializes refreshing it, since
+ * reads of one open file may run in parallel. A rename moves the handles of
+ * the files it moves (see handles_rename); the path and slot a handle is
+ * resolved from are changed and read under handles_lock.
+ *
+ * A handle also notices sequential reads. Once two reads in a row each start
+ * where the previous one ended, the next --readahead blocks of the chain after
+ * the read are read along with it into the readahead window of the handle, so
+ * the reads that follow are served from memory. The lock of the handle
+ * protects the window; writes (which hold the file lock exclusively) drop it.
+ */
+struct sfs_handle {
+    char *path;
+    struct sfs_entry entry;
+    off_t entry_off;
+    blockidx_t dir;
+    blockidx_t *blocks;
+    size_t nblocks;
+    int valid;
+    pthread_mutex_t lock;
+    off_t ra_next;          // offset right after the last read
+    unsigned ra_streak;     // number of sequential reads in a row
+    char *ra_buf;           // readahead window: ra_n blocks from block ra_first
+    size_t ra_first, ra_n;
+    unsigned renames;       // number of renames that moved the handle
+    struct sfs_handle *next;
+};
+
+static struct sfs_handle *open_handles = NULL;
+
+/*
+Function that (re)resolves the entry of a handle and rebuilds its block array.
+Returns 0 on success, or -ENOENT if the file no longer exists.
+*/
+static int handle_refresh(struct sfs_handle *h) {
+    // a rename may move the handle while it is resolved, in which case it is
+    // resolved again from where the rename left it
+    SCRATCH_SCOPE();
+    pthread_mutex_lock(&handles_lock);
+    unsigned renames = h->renames;
+    char *path = NULL;
+    if (h->path != NULL) {
+        path = (char *) scratch_alloc(strlen(h->path) + 1);
+        strcpy(path, h->path);
+    }
+    off_t entry_off = h->entry_off;
+    pthread_mutex_unlock(&handles_lock);
+
+    struct sfs_entry entry;
+    blockidx_t dir = SFS_BLOCKIDX_END;
+    int r = 0;
+    if (path == NULL && entry_off < 0) {
+        r = -ENOENT; // its file was replaced by a rename
+    } else if (path == NULL) {
+        img_read(&entry, sizeof(struct sfs_entry), entry_off);
+        if (strlen(entry.filename) == 0) {r = -ENOENT;}
+        dir = slot_dir(entry_off);
+    } else {
+        unsigned int off;
+        blockidx_t parent_blockidx;
+        r = get_entry(path, &entry, &off, &parent_blockidx);
+        if (r == 0) {
+            entry_off = entry_disk_off(path, off, parent_blockidx);
+            dir = entry_dir(path, parent_blockidx);
+        }
+    }
+
+    pthread_mutex_lock(&handles_lock);
+    int moved = h->renames != renames;
+    if (!moved && r == 0) {
+        h->entry = entry;
+        h->entry_off = entry_off;
+        h->dir = dir;
+    }
+    pthread_mutex_unlock(&handles_lock);
+    if (moved) {return handle_refresh(h);}
+    if (r != 0) {return r;}
+
+    h->nblocks = 0;
+    for (blockidx_t curr = h->entry.first_block; curr != SFS_BLOCKIDX_END; curr = blocktbl[curr]) {
+        h->nblocks++;
+    }
+    free(h->blocks);
+    h->blocks = (blockidx_t *) malloc((h->nblocks + 1) * sizeof(blockidx_t));
+    blockidx_t curr = h->entry.first_block;
+    for (size_t i = 0; i < h->nblocks; i++) {
+        h->blocks[i] = curr;
+        curr = blocktbl[curr];
+    }
+    __atomic_store_n(&h->ra_n, 0, __ATOMIC_RELAXED);
+    h->ra_next = -1;
+    h->ra_streak = 0;
+
+    __atomic_store_n(&h->valid, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+Function that returns the up-to-date handle stored in fi, or NULL if there is
+none (or its file is gone), in which case the caller falls back to the path.
+*/
+static struct sfs_handle *get_handle(struct fuse_file_info *fi) {
+    if (fi == NULL || fi->fh == 0) {return NULL;}
+    struct sfs_handle *h = (struct sfs_handle *) (uintptr_t) fi->fh;
+    if (__atomic_load_n(&h->valid, __ATOMIC_ACQUIRE)) {return h;}
+
+    pthread_mutex_lock(&h->lock);
+    int r = h->valid ? 0 : handle_refresh(h);
+    pthread_mutex_unlock(&h->lock);
+    return r == 0 ? h : NULL;
+}
+
+/*
+Function that sets up a handle for the file at path (or, if path is NULL, the
+entry at entry_off) and stores it in fi. The caller holds the file lock.
+Returns 0 on success, or -ENOENT.
+*/
+static int handle_open(const char *path, off_t entry_off, struct fuse_file_info *fi) {
+    struct sfs_handle *h = (struct sfs_handle *) calloc(1, sizeof(struct sfs_handle));
+    h->path = path != NULL ? strdup(path) : NULL;
+    h->entry_off = entry_off;
+    pthread_mutex_init(&h->lock, NULL);
+    int r = handle_refresh(h);
+    if (r != 0) {
+        pthread_mutex_destroy(&h->lock);
+        free(h->path); free(h);
+        return r;
+    }
+
+    pthread_mutex_lock(&handles_lock);
+    h->next = open_handles;
+    open_handles = h;
+    pthread_mutex_unlock(&handles_lock);
+    fi->fh = (uintptr_t) h;
+    return 0;
+}
+
+/*
+Function that drops the handle stored in fi, if any.
+*/
+static void handle_close(struct fuse_file_info *fi) {
+    struct sfs_handle *h = (struct sfs_handle *) (uintptr_t) fi->fh;
+    if (h == NULL) {return;}
+
+    pthread_mutex_lock(&handles_lock);
+    struct sfs_handle **pp = &open_handles;
+    while (*pp != h) {pp = &(*pp)->next;}
+    *pp = h->next;
+    pthread_mutex_unlock(&handles_lock);
+
+    pthread_mutex_destroy(&h->lock);
+    free(h->ra_buf); free(h->blocks); free(h->path); free(h);
+    fi->fh = 0;
+}
+
+/*
+Function that marks all handles of the entry at entry_off stale, after its
+chain, size or existence changed.
+*/
+static void invalidate_handles(off_t entry_off) {
+    pthread_mutex_lock(&handles_lock);
+    for (struct sfs_handle *h = open_handles; h != NULL; h = h->next) {
+        if (h->entry_off == entry_off) {__atomic_store_n(&h->valid, 0, __ATOMIC_RELEASE);}
+    }
+    pthread_mutex_unlock(&handles_lock);
+}
+
+/*
+Function that detaches the handles of the low-level API from the entry at
+entry_off, which was removed, so they fail instead of following the slot to
+whatever file takes it next. Handles of the path API only go stale.
+*/
+static void detach_handles(off_t entry_off) {
+    pthread_mutex_lock(&handles_lock);
+    for (struct sfs_handle *h = open_handles; h != NULL; h = h->next) {
+        if (h->entry_off != entry_off) {continue;}
+        if (h->path == NULL) {
+            h->entry_off = -1;
+            h->renames++;
+        }
+        __atomic_store_n(&h->valid, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&handles_lock);
+}
+
+/*
+Function that updates the handles after the entry at src_off was renamed from
+path to newpath and now lives at new_off, replacing the entry at tgt_off (or
+-1). Handles of the replaced file are detached from any path or slot, those of
+the moved file follow it, and so do those of files below a moved directory
+(whose entries stay where they are). Handles of the path API are found by
+path, since a stale handle of another file may still name one of the slots;
+path and newpath are NULL for the low-level API. The caller holds the file
+locks of both names and the directory locks, so no slot is reused meanwhile.
+*/
+static void handles_rename(const char *path, const char *newpath, off_t src_off, off_t new_off,
+                           off_t tgt_off) {
+    size_t len = path != NULL ? strlen(path) : 0;
+    pthread_mutex_lock(&handles_lock);
+    for (struct sfs_handle *h = open_handles; h != NULL; h = h->next) {
+        int is_tgt = path != NULL ? h->path != NULL && strcmp(h->path, newpath) == 0
+                                  : tgt_off >= 0 && h->entry_off == tgt_off;
+        int is_src = path != NULL ? h->path != NULL && strcmp(h->path, path) == 0
+                                  : h->entry_off == src_off;
+        if (is_tgt) {
+            free(h->path);
+            h->path = NULL;
+            h->entry_off = -1;
+        } else if (is_src) {
+            if (h->path != NULL) {
+                free(h->path);
+                h->path = strdup(newpath);
+            }
+            h->entry_off = new_off;
+        } else if (path != NULL && h->path != NULL && strncmp(h->path, path, len) == 0
+                   && h->path[len] == '/') {
+            char *moved = (char *) malloc(strlen(newpath) + strlen(h->path + len) + 1);
+            strcpy(moved, newpath);
+            strcat(moved, h->path + len);
+            free(h->path);
+            h->path = moved;
+        } else {
+            continue;
+        }
+        h->renames++;
+        __atomic_store_n(&h->valid, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&handles_lock);
+}
+
+/*
+Function that drops the readahead windows of all handles of the entry at
+entry_off, after its data changed.
+*/
+static void drop_readahead(off_t entry_off) {
+    pthread_mutex_lock(&handles_lock);
+    for (struct sfs_handle *h = open_handles; h != NULL; h = h->next) {
+        if (h->entry_off == entry_off) {__atomic_store_n(&h->ra_n, 0, __ATOMIC_RELAXED);}
+    }
+    pthread_mutex_unlock(&handles_lock);
+}
+
+
+
+/*
+Function that fills st with the attributes of the entry ent, or of the root
+directory if ent is NULL.
+*/
+static void entry_stat(const struct sfs_entry *ent, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    /* Set owner to user/group who mounted the image */
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    /* Last accessed/modified just now */
+    st->st_atime = time(NULL);
+    st->st_mtime = time(NULL);
+
+    if (ent == NULL) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else if (SFS_DIRECTORY & ent->size) {
+        st->st_size = ent->size & SFS_SIZEMASK;
+        st->st_mode = S_IFDIR;
+        st->st_nlink = 2;
+    } else {
+        st->st_size = ent->size;
+        st->st_mode = S_IFREG;
+        st->st_nlink = 1;
+    }
+}
+
+
+/*
+ * Retrieve information about a file or directory.
+ * You should populate fields of `stbuf` with appropriate information if the
+ * file exists and is accessible, or return an error otherwise.
+ *
+ * For directories, you should at least set st_mode (with S_IFDIR) and st_nlink.
+ * For files, you should at least set st_mode (with S_IFREG), st_nlink and
+ * st_size.
+ *
+ * Return 0 on success, < 0 on error.
+ */
+static int sfs_getattr(const char *path,
+                       struct stat *st)
+{
+    int res = 0;
+
+    log("getattr %s\n", path);
+    STATS_TIME(STATS_GETATTR);
+    TRACE_CALL(STATS_GETATTR, path, NULL, 0, 0, 0, NULL);
+
+    if (strcmp(path, "/") == 0) {
+        entry_stat(NULL, st);
+    } else if (stats_path(path)) {
+        stats_stat(st);
+    } else {
+        struct sfs_entry ret_entry;
+        unsigned int ret_entry_off;
+        blockidx_t parent_blockidx;
+        int r = get_entry(path, &ret_entry, &ret_entry_off, &parent_blockidx);
+        if (r != 0) {
+            res = r;
+        } else {
+            entry_stat(&ret_entry, st);
+        }
+    }
+
+    return res;
+}
+
+
+/*
+Function that fills st with the usage of the filesystem, from the counters.
+*/
+static void fill_statfs(struct statvfs *st) {
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = SFS_BLOCK_SIZE;
+    st->f_frsize = SFS_BLOCK_SIZE;
+    st->f_blocks = SFS_BLOCKTBL_NENTRIES;
+    pthread_mutex_lock(&alloc_lock);
+    st->f_bfree = st->f_bavail = free_blocks;
+    pthread_mutex_unlock(&alloc_lock);
+
+    // every directory has a fixed number of slots for entries
+    size_t dirs = __atomic_load_n(&used_dirs, __ATOMIC_RELAXED);
+    size_t entries = __atomic_load_n(&used_entries, __ATOMIC_RELAXED);
+    st->f_files = SFS_ROOTDIR_NENTRIES + dirs * SFS_DIR_NENTRIES;
+    st->f_ffree = st->f_favail = st->f_files - entries;
+    st->f_namemax = SFS_FILENAME_MAX - 1;
+}
+
+
+/*
+ * Return the capacity and usage of the filesystem, in blocks and in entries
+ * (as files). This takes constant time.
+ * Returns 0.
+ */
+static int sfs_statfs(const char *path, struct statvfs *st)
+{
+    log("statfs %s\n", path);
+    STATS_TIME(STATS_STATFS);
+    TRACE_CALL(STATS_STATFS, path, NULL, 0, 0, 0, NULL);
+
+    fill_statfs(st);
+    return 0;
+}
+
+
+/*
+ * Return directory contents for `path`.
+ * Use the function `filler` to add an entry to the directory. Every entry is
+ * passed with its attributes (from the directory entry itself) and its slot + 1
+ * as offset: when the buffer of FUSE is full filler returns 1, and the next
+ * call continues at `offset`. The entries are also put in the path cache, since
+ * a listing is usually followed by a getattr of every entry in it.
+ * Return 0 on success, < 0 on error.
+ */
+static int sfs_readdir(const char *path,
+                       void *buf,
+                       fuse_fill_dir_t filler,
+                       off_t offset,
+                       struct fuse_file_info *fi)
+{
+    (void)fi;
+    log("readdir %s offset=%ld\n", path, offset);
+    STATS_TIME(STATS_READDIR);
+    TRACE_CALL(STATS_READDIR, path, NULL, offset, 0, 0, NULL);
+
+    // find the directory
+    struct sfs_parent p;
+    if (strcmp(path, "/") == 0) {
+        p.dir = SFS_BLOCKIDX_END;
+    } else {
+        unsigned int entry_off;
+        blockidx_t parent_blockidx;
+        int r = get_entry(path, &p.entry, &entry_off, &parent_blockidx);
+        if (r != 0) {return r;}
+        if (!(p.entry.size & SFS_DIRECTORY)) {return -ENOTDIR;}
+        p.dir = p.entry.first_block;
+        p.entry_off = entry_disk_off(path, entry_off, parent_blockidx);
+    }
+    int r = dir_lock_parent(&p, 0);
+    if (r != 0) {return r;}
+
+    struct sfs_entry entbuf[SFS_ROOTDIR_NENTRIES];
+    size_t nentries;
+    struct sfs_entry *dir = read_dir(p.dir, entbuf, &nentries);
+
+    // path of the entries: the directory path, a slash and the name
+    size_t dirlen = p.dir == SFS_BLOCKIDX_END ? 0 : strlen(path);
+    char child[dirlen + 1 + SFS_FILENAME_MAX];
+    memcpy(child, path, dirlen);
+    child[dirlen] = '/';
+
+    for (size_t i = offset; i < nentries; i++)
+    {
+        struct sfs_entry *ent = dir + i;
+        if (strlen(ent->filename) == 0) {continue;}
+
+        struct stat st;
+        entry_stat(ent, &st);
+        strcpy(child + dirlen + 1, ent->filename);
+        dcache_insert(child, 0, ent, i, p.dir);
+        if (filler(buf, ent->filename, &st, i + 1) != 0) {break;}
+    }
+
+    pthread_rwlock_unlock(dir_lock(p.dir));
+    return 0;
+}
+
+
+/*
+Function that opens the file at path, for sfs_open and sfs_create (which must
+not call sfs_open, or it would be counted and traced twice).
+*/
+static int open_path(const char *path, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(file_lock(path));
+    int r = handle_open(path, 0, fi);
+    pthread_rwlock_unlock(file_lock(path));
+    return r;
+}
+
+/*
+ * Open the file at `path`. A handle with its entry and block chain is stored in
+ * fi->fh, which later read, write and ftruncate calls on this file use.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_open(const char *path, struct fuse_file_info *fi)
+{
+    log("open %s\n", path);
+    STATS_TIME(STATS_OPEN);
+    TRACE_CALL(STATS_OPEN, path, NULL, 0, 0, 0, fi);
+
+    if (stats_path(path)) {return stats_open(fi);}
+    return open_path(path, fi);
+}
+
+
+/*
+ * Release the handle of an open file, after the last reference to it is gone.
+ * Returns 0 (the return value is ignored by FUSE).
+ */
+static int sfs_release(const char *path, struct fuse_file_info *fi)
+{
+    log("release %s\n", path);
+    STATS_TIME(STATS_RELEASE);
+    TRACE_CALL(STATS_RELEASE, path, NULL, 0, 0, 0, fi);
+
+    if (stats_path(path)) {
+        stats_close(fi);
+        return 0;
+    }
+    handle_close(fi);
+    cache_flush();
+    return 0;
+}
+
+
+/*
+ * Called on every close of a file descriptor. Writes the cached blocks back to
+ * the image (all of them, the cache does not know which file a block is of).
+ * Returns 0.
+ */
+static int sfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    (void)fi;
+    log("flush %s\n", path);
+    STATS_TIME(STATS_FLUSH);
+    TRACE_CALL(STATS_FLUSH, path, NULL, 0, 0, 0, fi);
+
+    cache_flush();
+    return 0;
+}
+
+
+/*
+ * Make sure all writes so far have reached the image, including the ones still
+ * in the cache. Returns 0.
+ */
+static int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void)datasync; (void)fi;
+    log("fsync %s\n", path);
+    STATS_TIME(STATS_FSYNC);
+    TRACE_CALL(STATS_FSYNC, path, NULL, 0, 0, datasync, fi);
+
+    img_flush();
+    return 0;
+}
+
+
+/*
+Function that reads `size` bytes at `offset` of the open file h, which the
+caller has clamped to the file, using and refilling the readahead window.
+*/
+static void read_handle(struct sfs_handle *h, char *buf, size_t size, off_t offset) {
+    pthread_mutex_lock(&h->lock);
+
+    // the part at the start that is in the window
+    size_t done = 0;
+    size_t ra_start = h->ra_first * SFS_BLOCK_SIZE;
+    size_t ra_end = ra_start + __atomic_load_n(&h->ra_n, __ATOMIC_RELAXED) * SFS_BLOCK_SIZE;
+    if ((size_t)offset >= ra_start && (size_t)offset < ra_end) {
+        done = ra_end - offset < size ? ra_end - offset : size;
+        memcpy(buf, h->ra_buf + (offset - ra_start), done);
+    }
+    if (done < size) {
+        off_t from = offset + done;
+        read_chain(buf + done, h->blocks + from / SFS_BLOCK_SIZE, size - done, from % SFS_BLOCK_SIZE);
+    }
+
+    // on a sequential stream, fill the window with the blocks after this read
+    // when the next read would not be in it
+    h->ra_streak = offset == h->ra_next ? h->ra_streak + 1 : 0;
+    h->ra_next = offset + size;
+    size_t end = offset + size;
+    if (options.readahead > 0 && h->ra_streak >= 2 && end + size > ra_end) {
+        size_t first = end / SFS_BLOCK_SIZE;
+        size_t n = first < h->nblocks ? h->nblocks - first : 0;
+        if (n > options.readahead) {n = options.readahead;}
+        if (h->ra_buf == NULL) {h->ra_buf = (char *) malloc(options.readahead * SFS_BLOCK_SIZE);}
+        // without a window there is no readahead; the reads just go to disk
+        if (h->ra_buf == NULL) {n = 0;}
+        if (n > 0) {read_chain(h->ra_buf, h->blocks + first, n * SFS_BLOCK_SIZE, 0);}
+        h->ra_first = first;
+        __atomic_store_n(&h->ra_n, n, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&h->lock);
+}
+
+/*
+Function that does the work of sfs_read, which holds the file lock of path.
+*/
+static int read_locked(const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    // with an open handle the chain is already known
+    struct sfs_handle *h = get_handle(fi);
+    if (h != NULL) {
+        size_t filesize = h->entry.size & SFS_SIZEMASK;
+        if ((size_t)offset >= filesize) {return 0;}
+        if (filesize - (size_t)offset < size) {size = filesize - offset;}
+
+        read_handle(h, buf, size, offset);
+        return size;
+    }
+
+    // otherwise find the entry
+    if (path == NULL) {return -ENOENT;}
+
+    struct sfs_entry ent;
+    unsigned int ent_off;
+    blockidx_t parent_blockidx;
+    int r = get_entry(path, &ent, &ent_off, &parent_blockidx);
+    if (r != 0) {return r;}
+
+    // clamp the request to the end of the file
+    size_t filesize = ent.size & SFS_SIZEMASK;
+    if ((size_t)offset >= filesize) {return 0;}
+    if (filesize - (size_t)offset < size) {size = filesize - offset;}
+
+    // read only the blocks covering the range, straight into the buffer
+    read_file(buf, ent.first_block, size, offset);
+    return size;
+}
+
+/*
+ * Read contents of `path` into `buf` for  up to `size` bytes.
+ * Note that `size` may be bigger than the file actually is.
+ * Reading should start at offset `offset`; the OS will generally read your file
+ * in chunks of 4K byte.
+ * Returns the number of bytes read (writting into `buf`), or < 0 on error.
+ */
+static int sfs_read(const char *path,
+                    char *buf,
+                    size_t size,
+                    off_t offset,
+                    struct fuse_file_info *fi)
+{
+    log("read %s size=%zu offset=%ld\n", path, size, offset);
+    STATS_TIME(STATS_READ);
+    TRACE_CALL(STATS_READ, path, NULL, offset, size, 0, fi);
+
+    if (stats_path(path)) {return stats_read(fi, buf, size, offset);}
+    pthread_rwlock_rdlock(file_lock(path));
+    int r = read_locked(path, buf, size, offset, fi);
+    pthread_rwlock_unlock(file_lock(path));
+    return r;
+}
+
+
+/*
+Function that creates the directory `newdir` in the parent directory p (as
+path, for the path cache, which may be NULL). The offset of its entry is
+stored in ret_off, unless that is NULL.
+*/
+static int make_dir(const char *path, const struct sfs_parent *p, const char *newdir, off_t *ret_off)
+{
+    // find two consecutive empty blocks
+    blockidx_t pair[2];
+    pthread_mutex_lock(&alloc_lock);
+    if (alloc_blocks(2, 0, 1, pair) != 0) {
+        pthread_mutex_unlock(&alloc_lock);
+        return -ENOSPC; // no more space
+    }
+    blockidx_t block1 = pair[0];
+    blockidx_t block2 = pair[1];
+
+    // set correct values of block1 and block2 in the block table
+    blocktbl_set(block1, block2); // block 1 points to block 2
+    blocktbl_set(block2, SFS_BLOCKIDX_END); // block 2 points to end
+    pthread_mutex_unlock(&alloc_lock);
+    
+    // fill blocks with empty entries
+    // we make one large array of empty entries and write it at once
+    // instead of writing one by one which is inefficient
+    struct sfs_entry empty_ent;
+    memset(&empty_ent, 0, sizeof(empty_ent));
+    empty_ent.first_block = SFS_BLOCKIDX_EMPTY;
+
+    struct sfs_entry empty_entries[SFS_DIR_NENTRIES];
+    for (size_t i = 0; i < SFS_DIR_NENTRIES; i++)
+    {
+        memcpy(empty_entries + i, &empty_ent, sizeof(struct sfs_entry));
+    }
+    // the table and the new directory are written together
+    struct img_batch batch;
+    batch_init(&batch, 1);
+    blocktbl_flush_batch(&batch);
+    batch_add(&batch, empty_entries, SFS_DIR_SIZE, SFS_DATA_OFF + block1 * SFS_BLOCK_SIZE);
+    batch_submit(&batch);
+
+    // add the entry to the parent, with a single write of its slot
+    struct sfs_entry newent;
+    memset(&newent, 0, sizeof(newent));
+    strcpy(newent.filename, newdir);
+    newent.size = SFS_DIRECTORY;
+    newent.first_block = block1;
+
+    int r = dir_lock_parent(p, 1);
+    if (r == 0) {
+        r = dir_add(path, p, &newent, ret_off);
+        pthread_rwlock_unlock(dir_lock(p->dir));
+    }
+
+    if (r != 0) {
+        // give the blocks back
+        pthread_mutex_lock(&alloc_lock);
+        blocktbl_set(block1, SFS_BLOCKIDX_EMPTY);
+        blocktbl_set(block2, SFS_BLOCKIDX_EMPTY);
+        pthread_mutex_unlock(&alloc_lock);
+        blocktbl_flush();
+    }
+    return r;
+}
+
+/*
+ * Create directory at `path`.
+ * The `mode` argument describes the permissions, which you may ignore for this
+ * assignment.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_mkdir(const char *path,
+                     mode_t mode)
+{
+    log("mkdir %s mode=%o\n", path, mode);
+    STATS_TIME(STATS_MKDIR);
+    TRACE_CALL(STATS_MKDIR, path, NULL, 0, 0, mode, NULL);
+
+    if (stats_path(path)) {return -EEXIST;}
+
+    // Seperating the last name from the path
+    char* newdir;
+    get_child(path, &newdir);
+
+    // check size of name
+    if (strlen(newdir) >= 58) {return -ENAMETOOLONG;}
+
+    struct sfs_parent parent;
+    int r = get_parent_dir(path, &parent);
+    if (r != 0) {return r;}
+    return make_dir(path, &parent, newdir, NULL);
+}
+
+
+/*
+Function that removes the directory described by ret_entry, found on disk at
+ent_off in directory parent, if it is empty. The caller holds the file lock of
+the directory (path is only used for the path cache and may be NULL).
+*/
+static int remove_dir(const char *path, blockidx_t parent, struct sfs_entry ret_entry, off_t ent_off)
+{
+    int r = 0;
+    if (!(ret_entry.size & SFS_DIRECTORY)) {return -ENOTDIR;}
+
+    // lock the directory itself as well, so nothing is created in it meanwhile
+    blockidx_t block1 = ret_entry.first_block;
+    dir_lock_pair(parent, block1);
+
+    // check if directory is empty
+    if (!dir_empty(block1)) {r = -ENOTEMPTY;}
+
+    if (r == 0) {
+        // free the blocks
+        blockidx_t freeblock = SFS_BLOCKIDX_EMPTY;
+        pthread_mutex_lock(&alloc_lock);
+        blockidx_t block2 = blocktbl[block1];
+        blocktbl_set(block1, freeblock);
+        blocktbl_set(block2, freeblock);
+        pthread_mutex_unlock(&alloc_lock);
+        count_entry(&ret_entry, -1);
+
+        // remove entry from parents
+        strcpy(ret_entry.filename, "");
+        ret_entry.size = 0;
+        ret_entry.first_block = freeblock;
+
+        // write to disk, together with the table
+        struct img_batch batch;
+        batch_init(&batch, 1);
+        blocktbl_flush_batch(&batch);
+        batch_add(&batch, &ret_entry, sizeof(struct sfs_entry), ent_off);
+        batch_submit(&batch);
+        dir_index_set(parent, ent_off, "");
+        dir_index_drop(block1);
+        slot_gen_bump(ent_off);
+        detach_handles(ent_off);
+        dcache_forget(path);
+    }
+
+    dir_unlock_pair(parent, block1);
+    return r;
+}
+
+/*
+Function that does the work of sfs_rmdir, which holds the file lock of path.
+*/
+static int rmdir_locked(const char *path)
+{
+    struct sfs_entry ret_entry;
+    unsigned int ret_entry_off;
+    blockidx_t parent_blockidx;
+
+    int r = get_entry(path, &ret_entry, &ret_entry_off, &parent_blockidx);
+    if (r != 0) {return r;}
+    return remove_dir(path, entry_dir(path, parent_blockidx), ret_entry,
+                      entry_disk_off(path, ret_entry_off, parent_blockidx));
+}
+
+/*
+ * Remove directory at `path`.
+ * Directories may only be removed if they are empty, otherwise this function
+ * should return -ENOTEMPTY.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_rmdir(const char *path)
+{
+    log("rmdir %s\n", path);
+    STATS_TIME(STATS_RMDIR);
+    TRACE_CALL(STATS_RMDIR, path, NULL, 0, 0, 0, NULL);
+
+    if (stats_path(path)) {return -ENOTDIR;}
+
+    pthread_rwlock_wrlock(file_lock(path));
+    int r = rmdir_locked(path);
+    pthread_rwlock_unlock(file_lock(path));
+    return r;
+}
+
+
+/*
+Function that removes the file described by ret_entry, found on disk at
+ent_off in directory parent. The caller holds the file lock of the file (path
+is only used for the path cache and may be NULL).
+*/
+static int remove_file(const char *path, blockidx_t parent, struct sfs_entry ret_entry, off_t ent_off)
+{
+    if (ret_entry.size & SFS_DIRECTORY) {return -EISDIR;}
+
+    blockidx_t freeblock = SFS_BLOCKIDX_EMPTY;
+
+    // remove entries from blocktable
+
+    pthread_mutex_lock(&alloc_lock);
+    blockidx_t curr = ret_entry.first_block;
+    blockidx_t next;
+    while (curr != SFS_BLOCKIDX_END) {
+        next = blocktbl[curr];
+        blocktbl_set(curr, freeblock);
+        curr = next;
+    }
+    prealloc_release(ent_off);
+    pthread_mutex_unlock(&alloc_lock);
+    count_entry(&ret_entry, -1);
+
+    // remove entry from parent
+    strcpy(ret_entry.filename, "");
+    ret_entry.size = 0;
+    ret_entry.first_block = freeblock;
+
+    // write it to disk together with the table, and drop the chain of any
+    // open handles
+    pthread_rwlock_wrlock(dir_lock(parent));
+    struct img_batch batch;
+    batch_init(&batch, 1);
+    blocktbl_flush_batch(&batch);
+    batch_add(&batch, &ret_entry, sizeof(struct sfs_entry), ent_off);
+    batch_submit(&batch);
+    dir_index_set(parent, ent_off, "");
+    slot_gen_bump(ent_off);
+    detach_handles(ent_off);
+    dcache_forget(path);
+    pthread_rwlock_unlock(dir_lock(parent));
+
+    return 0;
+}
+
+/*
+Function that does the work of sfs_unlink, which holds the file lock of path.
+*/
+static int unlink_locked(const char *path)
+{
+    // Get entry of file
+    struct sfs_entry ret_entry;
+    unsigned int ret_entry_off;
+    blockidx_t parent_blockidx;
+
+    int r = get_entry(path, &ret_entry, &ret_entry_off, &parent_blockidx);
+    if (r != 0) {return r;}
+    return remove_file(path, entry_dir(path, parent_blockidx), ret_entry,
+                       entry_disk_off(path, ret_entry_off, parent_blockidx));
+}
+
+/*
+ * Remove file at `path`.
+ * Can not be used to remove directories.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_unlink(const char *path)
+{
+    log("unlink %s\n", path);
+    STATS_TIME(STATS_UNLINK);
+    TRACE_CALL(STATS_UNLINK, path, NULL, 0, 0, 0, NULL);
+
+    if (stats_path(path)) {return -EPERM;}
+
+    pthread_rwlock_wrlock(file_lock(path));
+    int r = unlink_locked(path);
+    pthread_rwlock_unlock(file_lock(path));
+    return r;
+}
+
+
+/*
+ * Create an empty file at `path`.
+ * The `mode` argument describes the permissions, which you may ignore for this
+ * assignment.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_create(const char *path,
+                      mode_t mode,
+                      struct fuse_file_info *fi)
+{
+    log("create %s mode=%o\n", path, mode);
+    STATS_TIME(STATS_CREATE);
+    TRACE_CALL(STATS_CREATE, path, NULL, 0, 0, mode, fi);
+
+    if (stats_path(path)) {return -EEXIST;}
+
+    // Get the filename
+    char *newdir;
+    get_child(path, &newdir);
+    if (strlen(newdir) >= 58) {return -ENAMETOOLONG;}
+
+    // create a new entry for a file
+    struct sfs_entry newfile;
+    memset(&newfile, 0, sizeof(newfile));
+    strcpy(newfile.filename, newdir);
+    newfile.size = 0;
+    newfile.first_block = SFS_BLOCKIDX_END;
+
+    // find an empty slot in the parent and write it
+    struct sfs_parent parent;
+    int r = get_parent_dir(path, &parent);
+    if (r != 0) {return r;}
+    r = dir_lock_parent(&parent, 1);
+    if (r != 0) {return r;}
+    r = dir_add(path, &parent, &newfile, NULL);
+    pthread_rwlock_unlock(dir_lock(parent.dir));
+    if (r != 0) {return r;}
+
+    // the new file is also opened
+    if (fi != NULL) {return open_path(path, fi);}
+    return 0;
+}
+
+
+/*
+ * Shrink or grow the file at `path` to `size` bytes.
+ * Excess bytes are thrown away, whereas any bytes added in the process should
+ * be nil (\0).
+ * Returns 0 on success, < 0 on error.
+ */
+
+/*
+Function that returns the last block of the chain starting at first, or
+SFS_BLOCKIDX_END for an empty chain.
+*/
+static blockidx_t chain_last(blockidx_t first) {
+    if (first == SFS_BLOCKIDX_END) {return SFS_BLOCKIDX_END;}
+    while (blocktbl[first] != SFS_BLOCKIDX_END) {first = blocktbl[first];}
+    return first;
+}
+
+/*
+Function that appends blocks to the chain of ret_entry, whose entry is at
+entry_off, so it goes from curr_block_amnt to block_amnt_need blocks. Blocks
+reserved for the file are used first. The indices of the new blocks are
+stored in newblocks, which must have room for the difference. The new blocks
+are marked unwritten. The caller writes the changed parts of the table back
+(blocktbl_flush).
+Returns 0 on success, or -ENOSPC if there are not enough free blocks.
+*/
+static int grow_chain(struct sfs_entry *ret_entry, off_t entry_off, unsigned int curr_block_amnt,
+                      unsigned int block_amnt_need, blockidx_t *newblocks)
+{
+    int blocks_to_add = block_amnt_need - curr_block_amnt;
+    blockidx_t lastblock = chain_last(ret_entry->first_block);
+
+    // finding right amount of free blocks, preferably right after the file
+    blockidx_t hint = lastblock == SFS_BLOCKIDX_END ? 0 : lastblock + 1;
+    pthread_mutex_lock(&alloc_lock);
+    size_t got = prealloc_take(entry_off, newblocks, blocks_to_add);
+    if (got > 0) {hint = newblocks[got - 1] + 1;}
+    int r = got < (size_t) blocks_to_add ? alloc_blocks(blocks_to_add - got, hint, 0, newblocks + got) : 0;
+    if (r != 0) {
+        for (size_t i = 0; i < got; i++) {
+            alloc_mark(newblocks[i], 1);
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        return r;
+    }
+
+    if (lastblock != SFS_BLOCKIDX_END) {
+        blocktbl_set(lastblock, newblocks[0]);
+    } else {
+        ret_entry->first_block = newblocks[0];
+    }
+    
+    // setting right values for those blocks in table
+    for (int i = 0; i < blocks_to_add - 1; i++)
+    {
+        blocktbl_set(newblocks[i], newblocks[i+1]);
+    }
+    blocktbl_set(newblocks[blocks_to_add - 1], SFS_BLOCKIDX_END);
+    pthread_mutex_unlock(&alloc_lock);
+
+    // they are not written here, but read as zeros until they are
+    for (int i = 0; i < blocks_to_add; i++) {
+        mark_unwritten(newblocks[i], 1);
+    }
+    return 0;
+}
+
+/*
+Function that writes zeros over the bytes from `size` up to `to` (at most to
+the end of the block) of `lastblock`, the last block of a file of `size` bytes
+that grows. Those bytes may still hold data from before the file was shrunk.
+An unwritten block reads as zeros already, so it is left alone.
+*/
+static void zero_tail(blockidx_t lastblock, size_t size, size_t to) {
+    size_t from = size % SFS_BLOCK_SIZE;
+    if (from == 0 || to <= size || block_unwritten(lastblock)) {return;}
+
+    size_t end = from + (to - size) < SFS_BLOCK_SIZE ? from + (to - size) : SFS_BLOCK_SIZE;
+    char zeros[SFS_BLOCK_SIZE];
+    memset(zeros, 0, end - from);
+    img_write(zeros, end - from, SFS_DATA_OFF + lastblock * SFS_BLOCK_SIZE + from);
+}
+
+/*
+Function that shrinks or grows the file at path described by ret_entry, found
+on disk at ent_off in directory dir, to `size` bytes and writes the updated
+entry back. The caller holds the file lock of path.
+*/
+static int truncate_entry(const char *path, blockidx_t dir, struct sfs_entry *ret_entry,
+                          off_t ent_off, off_t size)
+{
+    SCRATCH_SCOPE();
+    unsigned int curr_block_amnt = (ret_entry->size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+    unsigned int block_amnt_need = (size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+    if ((size_t)size > ret_entry->size) {
+        zero_tail(chain_last(ret_entry->first_block), ret_entry->size, size);
+    } else if ((size_t)size < ret_entry->size) {
+        // blocks reserved past the end go as well
+        pthread_mutex_lock(&alloc_lock);
+        prealloc_release(ent_off);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    if (block_amnt_need < curr_block_amnt) {
+        // SHRINKING
+
+        // getting all the blockidx in an array
+        blockidx_t *blocks = (blockidx_t *) scratch_alloc(curr_block_amnt*sizeof(blockidx_t));
+        blocks[0] = ret_entry->first_block;
+        for (size_t i = 1; i < curr_block_amnt; i++)
+        {
+            blocks[i] = blocktbl[blocks[i-1]];
+        }
+
+        // removing the right amount of blocks starting from the back
+        int blocks_torem = curr_block_amnt - block_amnt_need;
+        pthread_mutex_lock(&alloc_lock);
+        for (int i = 0; i < blocks_torem; i++)
+        {
+            blocktbl_set(blocks[curr_block_amnt - (1 + i)], SFS_BLOCKIDX_EMPTY);
+        }
+        
+        // write EOF on last used block
+        if (size != 0) {
+            blocktbl_set(blocks[curr_block_amnt - (1 + blocks_torem)], SFS_BLOCKIDX_END);
+        } else {
+            ret_entry->first_block = SFS_BLOCKIDX_END;
+        }
+        pthread_mutex_unlock(&alloc_lock);
+
+    } else if (block_amnt_need > curr_block_amnt) {
+        // GROWING: only the chain, the new blocks read as zeros until written
+        size_t nnew = block_amnt_need - curr_block_amnt;
+        blockidx_t *newblocks = (blockidx_t *) scratch_alloc(nnew * sizeof(blockidx_t));
+        int r = grow_chain(ret_entry, ent_off, curr_block_amnt, block_amnt_need, newblocks);
+        if (r != 0) {return r;}
+    }
+
+    // change size in entry
+    ret_entry->size = size;
+
+
+    // write the new entry for the file together with the changed parts of the
+    // table, and drop the chain of any open handles
+    pthread_rwlock_wrlock(dir_lock(dir));
+    struct img_batch batch;
+    batch_init(&batch, 1);
+    blocktbl_flush_batch(&batch);
+    batch_add(&batch, ret_entry, sizeof(struct sfs_entry), ent_off);
+    batch_submit(&batch);
+    invalidate_handles(ent_off);
+    dcache_forget(path);
+    pthread_rwlock_unlock(dir_lock(dir));
+    return 0;
+}
+
+/*
+Function that truncates the file at path, for sfs_truncate and sfs_ftruncate
+without a handle.
+*/
+static int truncate_path(const char *path, off_t size) {
+    pthread_rwlock_wrlock(file_lock(path));
+
+    // getting the entry
+    struct sfs_entry ret_entry;
+    unsigned int ret_entry_off;
+    blockidx_t parent_blockidx;
+    int r = get_entry(path, &ret_entry, &ret_entry_off, &parent_blockidx);
+    if (r == 0) {
+        r = truncate_entry(path, entry_dir(path, parent_blockidx), &ret_entry,
+                           entry_disk_off(path, ret_entry_off, parent_blockidx), size);
+    }
+
+    pthread_rwlock_unlock(file_lock(path));
+    return r;
+}
+
+static int sfs_truncate(const char *path, off_t size)
+{
+    log("truncate %s size=%ld\n", path, size);
+    STATS_TIME(STATS_TRUNCATE);
+    TRACE_CALL(STATS_TRUNCATE, path, NULL, 0, size, 0, NULL);
 
-    /* Allocate memory for the rootdir (and later, subdir) and read it from disk */
+    if (stats_path(path)) {return -EPERM;}
+    return truncate_path(path, size);
+}
 
-    /* Loop over all entries in the directory, looking for one with the name
-     * equal to the current part of the path. If it is the last part of the
-     * path, return it. If there are more parts remaining, recurse to handle
-     * that subdirectory. */
 
+/*
+ * Same as truncate, but for a file that is open, so its entry is already known
+ * through the handle in `fi`.
+ */
+static int sfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    log("ftruncate %s size=%ld\n", path, size);
+    STATS_TIME(STATS_FTRUNCATE);
+    TRACE_CALL(STATS_FTRUNCATE, path, NULL, 0, size, 0, fi);
 
-    char *pathc = (char*) malloc(strlen(path) + 1);
-    strncpy(pathc, path, strlen(path) + 1);
-    char *token = strtok(pathc, "/");
+    if (stats_path(path)) {return -EPERM;}
 
-    struct sfs_entry *root = (struct sfs_entry*) malloc(SFS_ROOTDIR_SIZE);
-    disk_read(root, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+    pthread_rwlock_wrlock(file_lock(path));
+    struct sfs_handle *h = get_handle(fi);
+    if (h == NULL) {
+        pthread_rwlock_unlock(file_lock(path));
+        return truncate_path(path, size);
+    }
 
-    int r = get_entry_rec(pathc, root, SFS_ROOTDIR_NENTRIES, parent_blockidx, token, ret_entry, ret_entry_off);
-    
-    free(root); free(pathc);
+    int r = truncate_entry(path, h->dir, &h->entry, h->entry_off, size);
+    pthread_rwlock_unlock(file_lock(path));
     return r;
 }
 
 
+/*
+Function that does the work of sfs_fallocate for the file described by ent,
+found on disk at ent_off in directory dir, up to byte `end`. The caller holds
+the file lock of the file.
+*/
+static int fallocate_entry(const char *path, blockidx_t dir, struct sfs_entry *ent, off_t ent_off,
+                           int mode, off_t end)
+{
+    if (ent->size & SFS_DIRECTORY) {return -EISDIR;}
+    if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+        // growing only links the blocks, which read as zeros
+        return (size_t)end > ent->size ? truncate_entry(path, dir, ent, ent_off, end) : 0;
+    }
+
+    size_t have = (ent->size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+    size_t need = (end + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+    if (need <= have) {return 0;}
+    pthread_mutex_lock(&alloc_lock);
+    int r = prealloc_reserve(ent_off, need - have, chain_last(ent->first_block));
+    pthread_mutex_unlock(&alloc_lock);
+    return r;
+}
 
 /*
- * Retrieve information about a file or directory.
- * You should populate fields of `stbuf` with appropriate information if the
- * file exists and is accessible, or return an error otherwise.
- *
- * For directories, you should at least set st_mode (with S_IFDIR) and st_nlink.
- * For files, you should at least set st_mode (with S_IFREG), st_nlink and
- * st_size.
- *
- * Return 0 on success, < 0 on error.
+ * Reserve space for the bytes from `offset` up to `offset + length` of the
+ * file at `path`, so that writing them cannot run out of space later and the
+ * file ends up in as few runs of consecutive blocks as possible. The file is
+ * grown to cover the range (reading as zeros), unless `mode` has
+ * FALLOC_FL_KEEP_SIZE: then the blocks are reserved past its end, for as long
+ * as the image stays mounted. Other modes are not supported.
+ * Returns 0 on success, < 0 on error.
  */
-static int sfs_getattr(const char *path,
-                       struct stat *st)
+static int sfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                         struct fuse_file_info *fi)
 {
-    int res = 0;
-
-    log("getattr %s\n", path);
+    log("fallocate %s mode=%x offset=%ld length=%ld\n", path, mode, offset, length);
+    STATS_TIME(STATS_FALLOCATE);
+    TRACE_CALL(STATS_FALLOCATE, path, NULL, offset, length, mode, fi);
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {return -EOPNOTSUPP;}
+    if (offset < 0 || length <= 0) {return -EINVAL;}
+
+    pthread_rwlock_wrlock(file_lock(path));
+    int r;
+    struct sfs_handle *h = get_handle(fi);
+    if (h != NULL) {
+        r = fallocate_entry(path, h->dir, &h->entry, h->entry_off, mode, offset + length);
+    } else {
+        struct sfs_entry ent;
+        unsigned int entry_off;
+        blockidx_t parent_blockidx;
+        r = get_entry(path, &ent, &entry_off, &parent_blockidx);
+        if (r == 0) {
+            r = fallocate_entry(path, entry_dir(path, parent_blockidx), &ent,
+                                entry_disk_off(path, entry_off, parent_blockidx), mode, offset + length);
+        }
+    }
+    pthread_rwlock_unlock(file_lock(path));
+    return r;
+}
 
-    memset(st, 0, sizeof(struct stat));
-    /* Set owner to user/group who mounted the image */
-    st->st_uid = getuid();
-    st->st_gid = getgid();
-    /* Last accessed/modified just now */
-    st->st_atime = time(NULL);
-    st->st_mtime = time(NULL);
+/*
+Function that does the work of sfs_write, which holds the file lock of path.
+*/
+static int write_locked(const char *path, const char *buf, size_t size, off_t offset,
+                        struct fuse_file_info *fi)
+{
+    SCRATCH_SCOPE();
+    // find the entry, through the handle if the file is open
+    struct sfs_entry ent;
+    off_t ent_off;
+    blockidx_t dir;
+    struct sfs_handle *h = get_handle(fi);
+    if (h != NULL) {
+        ent = h->entry;
+        ent_off = h->entry_off;
+        dir = h->dir;
+    } else if (path == NULL) {
+        return -ENOENT;
+    } else {
+        unsigned int ret_entry_off;
+        blockidx_t parent_blockidx;
+        int r = get_entry(path, &ent, &ret_entry_off, &parent_blockidx);
+        if (r != 0) {return r;}
+        ent_off = entry_disk_off(path, ret_entry_off, parent_blockidx);
+        dir = entry_dir(path, parent_blockidx);
+    }
+    if (ent.size & SFS_DIRECTORY) {return -EISDIR;}
+
+    // extend the chain only if the write goes past its last block; a gap
+    // between the end of the file and the write reads as zeros
+    size_t end = offset + size;
+    unsigned int curr_block_amnt = (ent.size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+    unsigned int block_amnt_need = (end + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+    if ((size_t)offset > ent.size && curr_block_amnt > 0) {
+        blockidx_t lastblock = h != NULL ? h->blocks[curr_block_amnt - 1] : chain_last(ent.first_block);
+        zero_tail(lastblock, ent.size, offset);
+    }
+    unsigned int blocks_added = 0;
+    blockidx_t newblocks[block_amnt_need > curr_block_amnt ? block_amnt_need - curr_block_amnt : 1];
+    if (block_amnt_need > curr_block_amnt) {
+        int r = grow_chain(&ent, ent_off, curr_block_amnt, block_amnt_need, newblocks);
+        if (r != 0) {return r;}
+        blocks_added = block_amnt_need - curr_block_amnt;
+    }
 
-    if (strcmp(path, "/") == 0) {
-        st->st_mode = S_IFDIR | 0755;
-        st->st_nlink = 2;
+    // the blocks covered by the write: from the handle, or by walking the chain
+    size_t first = offset / SFS_BLOCK_SIZE;
+    size_t nblocks = (end + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE - first;
+    blockidx_t blocks_buf[h != NULL ? 1 : nblocks];
+    blockidx_t *blocks;
+    if (h != NULL) {
+        if (blocks_added > 0) {
+            h->blocks = (blockidx_t *) realloc(h->blocks, (h->nblocks + blocks_added + 1) * sizeof(blockidx_t));
+            memcpy(h->blocks + h->nblocks, newblocks, blocks_added * sizeof(blockidx_t));
+            h->nblocks += blocks_added;
+        }
+        blocks = h->blocks + first;
     } else {
-        struct sfs_entry *ret_entry = (struct sfs_entry*) malloc(sizeof(struct sfs_entry));
-        unsigned int *ret_entry_off = (unsigned int*) malloc(sizeof(int));
-        blockidx_t *parent_blockidx = (blockidx_t *) malloc(sizeof(blockidx_t));
-        int r = get_entry(path, ret_entry, ret_entry_off, parent_blockidx);
-        if (r == -ENOENT) {
-            res = r;
-        } else {
-            st->st_size = ret_entry->size;
-            if (SFS_DIRECTORY & ret_entry->size) {
-                st->st_mode = S_IFDIR;
-                st->st_nlink = 2;
+        blockidx_t curr = ent.first_block;
+        for (size_t i = 0; i < first; i++) {curr = blocktbl[curr];}
+        for (size_t i = 0; i < nblocks; i++) {
+            blocks_buf[i] = curr;
+            curr = blocktbl[curr];
+        }
+        blocks = blocks_buf;
+    }
+
+    // the runs of physically consecutive blocks; runs with a partial head or
+    // tail block are read-modify-written through a buffer, whose head and
+    // tail blocks are read in one batch first (or zeroed, if unwritten)
+    char *run_bufs[nblocks];
+    struct img_batch batch;
+    batch_init(&batch, 0);
+    for (size_t i = 0, j; i < nblocks; i = j) {
+        j = i + chain_run(blocks + i, nblocks - i);
+        run_bufs[i] = NULL;
+
+        // byte range of this run in the file, and the part the write covers
+        size_t run_start = (first + i) * SFS_BLOCK_SIZE;
+        size_t run_end = (first + j) * SFS_BLOCK_SIZE;
+        size_t from = (size_t)offset > run_start ? (size_t)offset : run_start;
+        size_t to = end < run_end ? end : run_end;
+        if (from == run_start && to == run_end) {continue;}
+
+        off_t disk_off = SFS_DATA_OFF + blocks[i] * SFS_BLOCK_SIZE;
+        run_bufs[i] = (char *) scratch_alloc(run_end - run_start);
+        if (from != run_start) {
+            if (block_unwritten(blocks[i])) {
+                memset(run_bufs[i], 0, SFS_BLOCK_SIZE);
+            } else {
+                batch_add(&batch, run_bufs[i], SFS_BLOCK_SIZE, disk_off);
             }
-            else {
-                st->st_mode = S_IFREG;
-                st->st_nlink = 1;
+        }
+        // (unless the tail block is the head block, which is already read)
+        if (to != run_end && (j - i > 1 || from == run_start)) {
+            char *tail = run_bufs[i] + (j - i - 1) * SFS_BLOCK_SIZE;
+            if (block_unwritten(blocks[j - 1])) {
+                memset(tail, 0, SFS_BLOCK_SIZE);
+            } else {
+                batch_add(&batch, tail, SFS_BLOCK_SIZE, disk_off + (j - i - 1) * SFS_BLOCK_SIZE);
             }
         }
-        free(ret_entry); free(ret_entry_off);
+    }
+    batch_submit(&batch);
+
+    // write every run with one disk_write: whole blocks straight from the FUSE
+    // buffer, the others from their buffer. They go out in one batch with the
+    // changed parts of the table.
+    batch_init(&batch, 1);
+    for (size_t i = 0, j; i < nblocks; i = j) {
+        j = i + chain_run(blocks + i, nblocks - i);
+
+        size_t run_start = (first + i) * SFS_BLOCK_SIZE;
+        size_t run_end = (first + j) * SFS_BLOCK_SIZE;
+        size_t from = (size_t)offset > run_start ? (size_t)offset : run_start;
+        size_t to = end < run_end ? end : run_end;
+        off_t disk_off = SFS_DATA_OFF + blocks[i] * SFS_BLOCK_SIZE;
+
+        if (run_bufs[i] == NULL) {
+            batch_add(&batch, buf + (from - offset), run_end - run_start, disk_off);
+        } else {
+            memcpy(run_bufs[i] + (from - run_start), buf + (from - offset), to - from);
+            batch_add(&batch, run_bufs[i], run_end - run_start, disk_off);
+        }
+    }
+    blocktbl_flush_batch(&batch);
+    batch_submit(&batch);
+    for (size_t i = 0; i < nblocks; i++) {
+        mark_unwritten(blocks[i], 0);
+    }
+    drop_readahead(ent_off);
+
+    // then update the size in the entry with a single entry write, which
+    // needs the lock of its directory
+    if (end > ent.size) {
+        ent.size = end;
+        write_entry(path, dir, &ent, ent_off);
+        invalidate_handles(ent_off);
+        if (h != NULL) {
+            h->entry = ent;
+            __atomic_store_n(&h->valid, 1, __ATOMIC_RELEASE);
+        }
     }
 
-    return res;
+    return size;
 }
 
-
 /*
- * Return directory contents for `path`. This function should simply fill the
- * filenames - any additional information (e.g., whether something is a file or
- * directory) is later retrieved through getattr calls.
- * Use the function `filler` to add an entry to the directory. Use it like:
- *  filler(buf, <dirname>, NULL, 0);
- * Return 0 on success, < 0 on error.
+ * Write contents of `buf` (of `size` bytes) to the file at `path`.
+ * The file is grown if nessecary, and any bytes already present are overwritten
+ * (whereas any other data is left intact). The `offset` argument specifies how
+ * many bytes should be skipped in the file, after which `size` bytes from
+ * buffer are written.
+ * This means that the new file size will be max(old_size, offset + size).
+ * Returns the number of bytes written, or < 0 on error.
  */
-static int sfs_readdir(const char *path,
-                       void *buf,
-                       fuse_fill_dir_t filler,
-                       off_t offset,
-                       struct fuse_file_info *fi)
+static int sfs_write(const char *path,
+                     const char *buf,
+                     size_t size,
+                     off_t offset,
+                     struct fuse_file_info *fi)
 {
-    (void)offset; (void)fi;
-    log("readdir %s\n", path);
-    int err;
+    log("write %s data='%.*s' size=%zu offset=%ld\n", path, (int)size, buf,
+        size, offset);
+    STATS_TIME(STATS_WRITE);
+    TRACE_CALL(STATS_WRITE, path, NULL, offset, size, 0, fi);
 
-    if (strcmp(path, "/") == 0) {
-        // root directory
+    if (size == 0) {return 0;}
+
+    pthread_rwlock_wrlock(file_lock(path));
+    int r = write_locked(path, buf, size, offset, fi);
+    pthread_rwlock_unlock(file_lock(path));
+    return r;
+}
 
-        struct sfs_entry *rootdir = (struct sfs_entry *) malloc(SFS_ROOTDIR_SIZE);
-        disk_read(rootdir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
 
-        for (size_t i = 0; i < SFS_ROOTDIR_NENTRIES; i++)
-        {
-            struct sfs_entry *ent = rootdir + i;
-            if (strlen(ent->filename) == 0) {
-                continue;
-            } else {
-                err = filler(buf, ent->filename, NULL, 0);
-            }
-        }
+/*
+Function that gives all blocks of the chain starting at first back to the
+allocator. The caller holds alloc_lock and writes the table back.
+*/
+static void free_chain(blockidx_t first) {
+    blockidx_t curr = first;
+    while (curr != SFS_BLOCKIDX_END) {
+        blockidx_t next = blocktbl[curr];
+        blocktbl_set(curr, SFS_BLOCKIDX_EMPTY);
+        curr = next;
+    }
+}
+
+/*
+Function that moves the entry src, at src_off in directory sdir, to the name
+newname in directory dp, replacing the entry tgt at tgt_off there if tgt_off
+is not -1. Only entries are written: the chain of the file stays as it is. In
+the same directory the entry keeps its slot (and so its low-level inode).
+The caller holds rename_lock, the file locks of both names and the locks of
+sdir, dp and, if it is a directory, tgt. path and newpath are NULL for the
+low-level API.
+Returns 0 on success, -ENOTDIR, -EISDIR, -ENOTEMPTY or -ENOSPC.
+*/
+static int move_entry(const char *path, const char *newpath, blockidx_t sdir,
+                      struct sfs_entry src, off_t src_off, const struct sfs_parent *dp,
+                      const char *newname, struct sfs_entry tgt, off_t tgt_off)
+{
+    int is_dir = (src.size & SFS_DIRECTORY) != 0;
+    if (tgt_off >= 0) {
+        if (is_dir && !(tgt.size & SFS_DIRECTORY)) {return -ENOTDIR;}
+        if (!is_dir && (tgt.size & SFS_DIRECTORY)) {return -EISDIR;}
+    }
+    if (tgt_off >= 0 && is_dir && !dir_empty(tgt.first_block)) {
+        // only an empty directory can be replaced
+        return -ENOTEMPTY;
+    }
 
-        free(rootdir); 
-        return err;
+    struct sfs_entry moved = src;
+    memset(moved.filename, 0, SFS_FILENAME_MAX);
+    strcpy(moved.filename, newname);
+    struct sfs_entry empty;
+    memset(&empty, 0, sizeof(empty));
+    empty.first_block = SFS_BLOCKIDX_EMPTY;
+
+    // where the entry goes: its own slot, that of the target, or a free one
+    off_t new_off;
+    int written = 0;
+    if (sdir == dp->dir) {
+        new_off = src_off;
+    } else if (tgt_off >= 0) {
+        new_off = tgt_off;
     } else {
+        int r = dir_add(newpath, dp, &moved, &new_off);
+        if (r != 0) {return r;}
+        count_entry(&moved, -1); // it was only moved
+        written = 1;
+    }
+
+    struct img_batch batch;
+    batch_init(&batch, 1);
+    if (tgt_off >= 0) {
+        pthread_mutex_lock(&alloc_lock);
+        free_chain(tgt.first_block);
+        prealloc_release(tgt_off);
+        pthread_mutex_unlock(&alloc_lock);
+        count_entry(&tgt, -1);
+        blocktbl_flush_batch(&batch);
+        if (tgt_off != new_off) {batch_add(&batch, &empty, sizeof(struct sfs_entry), tgt_off);}
+    }
+    if (!written) {batch_add(&batch, &moved, sizeof(struct sfs_entry), new_off);}
+    if (new_off != src_off) {batch_add(&batch, &empty, sizeof(struct sfs_entry), src_off);}
+    batch_submit(&batch);
+    if (tgt_off >= 0) {
+        if (tgt_off != new_off) {dir_index_set(dp->dir, tgt_off, "");}
+        if (tgt.size & SFS_DIRECTORY) {dir_index_drop(tgt.first_block);}
+    }
+    if (!written) {dir_index_set(dp->dir, new_off, newname);}
+    if (new_off != src_off) {dir_index_set(sdir, src_off, "");}
+    // the slots that lost their file get a new generation
+    if (tgt_off >= 0) {slot_gen_bump(tgt_off);}
+    if (new_off != src_off) {slot_gen_bump(src_off);}
+    if (new_off != src_off) {
+        pthread_mutex_lock(&alloc_lock);
+        prealloc_move(src_off, new_off);
+        pthread_mutex_unlock(&alloc_lock);
+    }
 
-        struct sfs_entry *ret_entry = (struct sfs_entry*) malloc(sizeof(struct sfs_entry));
-        unsigned int *ret_entry_offset = (unsigned int *) malloc(sizeof(unsigned int));
-        blockidx_t *parent_blockidx = (blockidx_t *) malloc(sizeof(blockidx_t));
+    handles_rename(path, newpath, src_off, new_off, tgt_off);
+    if (is_dir) {
+        dcache_clear();
+    } else {
+        dcache_forget(path);
+        dcache_forget(newpath);
+    }
+    return 0;
+}
 
-        int r = get_entry(path, ret_entry, ret_entry_offset, parent_blockidx);
+/*
+Function that does the work of sfs_rename, which holds rename_lock and the
+file locks of both paths.
+*/
+static int rename_locked(const char *path, const char *newpath, const char *newname)
+{
+    while (1) {
+        struct sfs_entry src;
+        unsigned int src_slot;
+        blockidx_t src_parent_blockidx;
+        int r = get_entry(path, &src, &src_slot, &src_parent_blockidx);
         if (r != 0) {return r;}
 
-        free(ret_entry_offset); free(parent_blockidx);
+        struct sfs_parent sp, dp;
+        r = get_parent_dir(path, &sp);
+        if (r == 0) {r = get_parent_dir(newpath, &dp);}
+        if (r != 0) {return r;}
 
-        // get directory data
-        struct sfs_entry *dir = (struct sfs_entry*) malloc(SFS_DIR_SIZE);
-        load_dir(dir, ret_entry->first_block);
+        // a directory that is replaced is locked too, so that it stays empty
+        blockidx_t dirs[3] = {sp.dir, dp.dir, SFS_BLOCKIDX_EMPTY};
+        size_t ndirs = 2;
+        struct sfs_entry tgt;
+        unsigned int tgt_slot;
+        blockidx_t tgt_parent_blockidx;
+        if (get_entry(newpath, &tgt, &tgt_slot, &tgt_parent_blockidx) == 0 && (tgt.size & SFS_DIRECTORY)) {
+            dirs[ndirs++] = tgt.first_block;
+        }
 
-        // find all files
-        struct sfs_entry *ent;
-        for (size_t i = 0; i < SFS_DIR_NENTRIES; i++)
-        {
-            ent = dir + i;
-            if (strlen(ent->filename) == 0) {
-                continue;
+        dir_lock_all(dirs, ndirs);
+        r = dir_check_parent(&sp);
+        if (r == 0) {r = dir_check_parent(&dp);}
+        if (r == 0) {
+            // the target as it is now that it cannot change any more
+            off_t src_off = entry_disk_off(path, src_slot, src_parent_blockidx);
+            off_t tgt_off = dir_find(dp.dir, newname, &tgt);
+            if (tgt_off >= 0 && (tgt.size & SFS_DIRECTORY) && dirs[ndirs - 1] != tgt.first_block) {
+                r = -EAGAIN;
             } else {
-                err = filler(buf, ent->filename, NULL, 0);
+                r = move_entry(path, newpath, sp.dir, src, src_off, &dp, newname, tgt, tgt_off);
             }
         }
-
-        free(ret_entry); free(dir);
-        return err;
+        dir_unlock_all(dirs, ndirs);
+        if (r != -EAGAIN) {return r;}
     }
 }
 
-
 /*
- * Read contents of `path` into `buf` for  up to `size` bytes.
- * Note that `size` may be bigger than the file actually is.
- * Reading should start at offset `offset`; the OS will generally read your file
- * in chunks of 4K byte.
- * Returns the number of bytes read (writting into `buf`), or < 0 on error.
+ * Move/rename the file at `path` to `newpath`.
+ * Only directory entries change, so this costs a few entry writes whatever
+ * the size of the file. An existing file (or empty directory) at `newpath` is
+ * replaced. A directory cannot be moved into itself.
+ * Returns 0 on succes, < 0 on error.
  */
-static int sfs_read(const char *path,
-                    char *buf,
-                    size_t size,
-                    off_t offset,
-                    struct fuse_file_info *fi)
+static int sfs_rename(const char *path,
+                      const char *newpath)
 {
-    (void)fi;
-    log("read %s size=%zu offset=%ld\n", path, size, offset);
-
-    // find the entry
-
-    struct sfs_entry *ent = (struct sfs_entry *) malloc(sizeof(struct sfs_entry));
-    unsigned int *ent_off = (unsigned int*) malloc(sizeof(unsigned int));
-    blockidx_t *parent_blockidx = (blockidx_t *) malloc(sizeof(blockidx_t));
-
-    if (get_entry(path, ent, ent_off, parent_blockidx) == -ENOENT) {
-        return -ENOENT;
+    log("rename %s %s\n", path, newpath);
+    STATS_TIME(STATS_RENAME);
+    TRACE_CALL(STATS_RENAME, path, newpath, 0, 0, 0, NULL);
+
+    if (stats_path(path) || stats_path(newpath)) {return -EACCES;}
+    if (strcmp(path, newpath) == 0) {return 0;}
+    size_t len = strlen(path);
+    if (strncmp(newpath, path, len) == 0 && newpath[len] == '/') {return -EINVAL;}
+    char *newname;
+    get_child(newpath, &newname);
+    if (strlen(newname) >= SFS_FILENAME_MAX) {return -ENAMETOOLONG;}
+
+    // the file locks of both paths, in a fixed order
+    pthread_rwlock_t *a = file_lock(path), *b = file_lock(newpath);
+    if (a > b) {
+        pthread_rwlock_t *t = a;
+        a = b;
+        b = t;
     }
-
-    free(ent_off); free(parent_blockidx); // won't use those
-    if (ent->first_block == SFS_BLOCKIDX_END) {return 0;}
-
-    // Load the file in memory entirely
-    int amnt_blocks = count_blocks(ent->first_block);
-    char *file_buf = (char *) malloc(amnt_blocks * SFS_BLOCK_SIZE);
-    read_file(file_buf, ent->first_block);
-
-    // read into the buffer the right bytes
-    if (ent->size - (size_t)offset < size) {size = ent->size - offset;}
-    memcpy(buf, file_buf + offset, size);
-    
-    free(ent); free(file_buf);
-    return size;
+    pthread_mutex_lock(&rename_lock);
+    pthread_rwlock_wrlock(a);
+    if (b != a) {pthread_rwlock_wrlock(b);}
+    int r = rename_locked(path, newpath, newname);
+    if (b != a) {pthread_rwlock_unlock(b);}
+    pthread_rwlock_unlock(a);
+    pthread_mutex_unlock(&rename_lock);
+    return r;
 }
 
 
 /*
- * Create directory at `path`.
- * The `mode` argument describes the permissions, which you may ignore for this
- * assignment.
- * Returns 0 on success, < 0 on error.
+ * Defragmentation. The chain of a file is fragmented when it is not one run of
+ * consecutive blocks; its fragmentation score is the fraction of the steps
+ * along the chain that jump, (runs - 1) / (blocks - 1), so 0 for a contiguous
+ * file and 1 when no two of its blocks are next to each other. defrag_entry
+ * moves a fragmented chain to a single free run (or, without one, to fewer
+ * runs than it had): it copies the data to the new blocks, then links them,
+ * points the entry at them and frees the old blocks in one batch, all under
+ * the file lock of the file. Directories are not moved, since their locks
+ * are striped by their first block.
+ * Offline, --frag-report prints the score of every file and --defrag
+ * defragments every file, after which the program exits without mounting.
+ * Online, with --defrag-interval=S, a background thread goes over all files
+ * every S seconds.
  */
-static int sfs_mkdir(const char *path,
-                     mode_t mode)
-{
-    log("mkdir %s mode=%o\n", path, mode);
-
-    // Seperating the last name from the path
-    char* newdir;
-    get_child(path, &newdir);
+static pthread_t defrag_thread;
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_cond = PTHREAD_COND_INITIALIZER;
+static int defrag_running = 0;
 
-    // check size of name
-    if (strlen(newdir) >= 58) {return -ENAMETOOLONG;}
+/*
+Function that returns the number of runs of consecutive blocks in the chain
+starting at first, and stores its length in nblocks.
+*/
+static size_t chain_runs(blockidx_t first, size_t *nblocks) {
+    size_t runs = 0;
+    *nblocks = 0;
+    for (blockidx_t curr = first, prev = SFS_BLOCKIDX_END; curr != SFS_BLOCKIDX_END;
+         prev = curr, curr = blocktbl[curr]) {
+        if (*nblocks == 0 || curr != prev + 1) {runs++;}
+        (*nblocks)++;
+    }
+    return runs;
+}
 
-    // find two empty blocks
-    blockidx_t *blocktable = (blockidx_t*) malloc(SFS_BLOCKTBL_SIZE);
-    disk_read(blocktable, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+static double frag_score(size_t nblocks, size_t runs) {
+    return nblocks > 1 ? (double) (runs - 1) / (nblocks - 1) : 0;
+}
 
-    blockidx_t block1 = SFS_BLOCKIDX_EMPTY;
-    blockidx_t block2 = SFS_BLOCKIDX_EMPTY;
-    for (size_t i = 0; i < SFS_BLOCKTBL_NENTRIES - 1; i++)
-    {
-        if (blocktable[i] == SFS_BLOCKIDX_EMPTY && blocktable[i+1] == SFS_BLOCKIDX_EMPTY) {
-            block1 = i;
-            block2 = i + 1;
-            break;
+/*
+Function that moves the chain of the file described by ent, found on disk at
+ent_off in directory dir, to fewer runs of blocks if it can. The caller holds
+the file lock of the file. Returns 1 if the chain was moved, 0 if not.
+*/
+static int defrag_entry(const char *path, blockidx_t dir, struct sfs_entry *ent, off_t ent_off) {
+    size_t n;
+    size_t runs = chain_runs(ent->first_block, &n);
+    if (runs <= 1) {return 0;}
+
+    SCRATCH_SCOPE();
+    blockidx_t *old = (blockidx_t *) scratch_alloc(n * sizeof(blockidx_t));
+    blockidx_t *moved = (blockidx_t *) scratch_alloc(n * sizeof(blockidx_t));
+    old[0] = ent->first_block;
+    for (size_t i = 1; i < n; i++) {old[i] = blocktbl[old[i - 1]];}
+
+    // new blocks, as far to the front of the disk as they fit
+    pthread_mutex_lock(&alloc_lock);
+    int r = alloc_blocks(n, 0, 0, moved);
+    size_t new_runs = 1;
+    for (size_t i = 1; r == 0 && i < n; i++) {new_runs += moved[i] != moved[i - 1] + 1;}
+    if (r == 0 && new_runs >= runs) {
+        for (size_t i = 0; i < n; i++) {alloc_mark(moved[i], 1);}
+        r = -ENOSPC;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (r != 0) {return 0;}
+
+    // copy the data (unwritten blocks stay unwritten), one write per run
+    char *data = (char *) scratch_alloc(n * SFS_BLOCK_SIZE);
+    read_chain(data, old, n * SFS_BLOCK_SIZE, 0);
+    struct img_batch batch;
+    batch_init(&batch, 1);
+    for (size_t i = 0, j; i < n; i = j) {
+        int unwritten = block_unwritten(old[i]);
+        j = i + 1;
+        while (j < n && moved[j] == moved[j - 1] + 1 && block_unwritten(old[j]) == unwritten) {j++;}
+        if (!unwritten) {
+            batch_add(&batch, data + i * SFS_BLOCK_SIZE, (j - i) * SFS_BLOCK_SIZE,
+                      SFS_DATA_OFF + moved[i] * SFS_BLOCK_SIZE);
         }
     }
-    if (block1 == SFS_BLOCKIDX_EMPTY) {return -1;} // no more space
-
-    // set correct values of block1 and block2 in the block table
-    disk_write(&block2, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + block1 * sizeof(blockidx_t)); // block 1 points to block 2
-    blockidx_t end = SFS_BLOCKIDX_END;
-    disk_write(&end, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + block2 * sizeof(blockidx_t)); // block 2 points to end
-    
-    // fill blocks with empty entries
-    // we make one large array of empty entries and write it at once
-    // instead of writing one by one which is inefficient
-    struct sfs_entry *empty_ent = (struct sfs_entry*) malloc(sizeof(struct sfs_entry));
-    strcpy(empty_ent->filename, "");
-    empty_ent->size = 0;
-    empty_ent->first_block = SFS_BLOCKIDX_EMPTY;
+    batch_submit(&batch);
 
-    struct sfs_entry *empty_entries = (struct sfs_entry*) malloc(SFS_DIR_SIZE);
-    for (size_t i = 0; i < SFS_DIR_NENTRIES; i++)
-    {
-        memcpy(empty_entries + i, empty_ent, sizeof(struct sfs_entry));
+    // then switch the file over to them
+    pthread_mutex_lock(&alloc_lock);
+    for (size_t i = 0; i < n; i++) {
+        blocktbl_set(moved[i], i + 1 < n ? moved[i + 1] : SFS_BLOCKIDX_END);
+        mark_unwritten(moved[i], block_unwritten(old[i]));
     }
-    disk_write(empty_entries, SFS_DIR_SIZE, SFS_DATA_OFF + block1 * SFS_BLOCK_SIZE);
-
-    free(empty_entries); free(empty_ent);
-
-    // Finding an empty entry in parent
-    if (in_root(path) == 1) {
-        // find it in root directory
-        struct sfs_entry *rootdir = (struct sfs_entry *) malloc(SFS_ROOTDIR_SIZE);;
-        disk_read(rootdir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+    for (size_t i = 0; i < n; i++) {blocktbl_set(old[i], SFS_BLOCKIDX_EMPTY);}
+    pthread_mutex_unlock(&alloc_lock);
+    ent->first_block = moved[0];
+
+    pthread_rwlock_wrlock(dir_lock(dir));
+    batch_init(&batch, 1);
+    blocktbl_flush_batch(&batch);
+    batch_add(&batch, ent, sizeof(struct sfs_entry), ent_off);
+    batch_submit(&batch);
+    invalidate_handles(ent_off);
+    dcache_forget(path);
+    pthread_rwlock_unlock(dir_lock(dir));
+
+    log("defrag %s: %zu runs -> %zu\n", path != NULL ? path : ent->filename, runs, new_runs);
+    return 1;
+}
 
-        struct sfs_entry *empty_ent;
-        for (size_t i = 0; i < SFS_ROOTDIR_NENTRIES; i++)
-        {
-            empty_ent = rootdir + i;
-            if (strlen(empty_ent->filename) == 0) {
-                break;
-            }
+/*
+Function that calls fn for every file below the directory p, whose path is
+path ("" for the root directory), with its path, the offset of its entry on
+disk and the entry as it was when the directory was read. Directories that
+are removed in the meantime are skipped.
+*/
+static void walk_files(const char *path, const struct sfs_parent *p,
+                       void (*fn)(const char *, off_t, const struct sfs_entry *))
+{
+    struct sfs_entry buf[SFS_ROOTDIR_NENTRIES], ents[SFS_ROOTDIR_NENTRIES];
+    size_t nentries;
+    if (dir_lock_parent(p, 0) != 0) {return;}
+    struct sfs_entry *dir = read_dir(p->dir, buf, &nentries);
+    memcpy(ents, dir, nentries * sizeof(struct sfs_entry));
+    pthread_rwlock_unlock(dir_lock(p->dir));
+
+    size_t dirlen = strlen(path);
+    char child[dirlen + 1 + SFS_FILENAME_MAX];
+    memcpy(child, path, dirlen);
+    child[dirlen] = '/';
+    for (size_t i = 0; i < nentries; i++) {
+        if (strlen(ents[i].filename) == 0) {continue;}
+
+        strcpy(child + dirlen + 1, ents[i].filename);
+        off_t off = dir_slot_off(p->dir, i);
+        if (ents[i].size & SFS_DIRECTORY) {
+            struct sfs_parent sub = {ents[i].first_block, ents[i], off};
+            walk_files(child, &sub, fn);
+        } else {
+            fn(child, off, &ents[i]);
         }
+    }
+}
 
-        strcpy(empty_ent->filename, newdir);
-        empty_ent->size = SFS_DIRECTORY;
-        empty_ent->first_block = block1;
-
-        disk_write(rootdir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-        free(rootdir);
+/*
+Function that defragments the file at path, whose entry was seen at off, if
+it is still there once its file lock is held.
+*/
+static void defrag_file(const char *path, off_t off, const struct sfs_entry *seen) {
+    if (options.lowlevel) {
+        pthread_rwlock_t *lock = ino_lock(slot_ino(off));
+        pthread_rwlock_wrlock(lock);
+        struct sfs_entry ent;
+        img_read(&ent, sizeof(struct sfs_entry), off);
+        if (strcmp(ent.filename, seen->filename) == 0 && !(ent.size & SFS_DIRECTORY)) {
+            defrag_entry(NULL, slot_dir(off), &ent, off);
+        }
+        pthread_rwlock_unlock(lock);
+        return;
+    }
 
-    } else {
-        // find it in subdirectory
+    pthread_rwlock_wrlock(file_lock(path));
+    struct sfs_entry ent;
+    unsigned int entry_off;
+    blockidx_t parent_blockidx;
+    if (get_entry(path, &ent, &entry_off, &parent_blockidx) == 0 && !(ent.size & SFS_DIRECTORY)) {
+        defrag_entry(path, entry_dir(path, parent_blockidx), &ent,
+                     entry_disk_off(path, entry_off, parent_blockidx));
+    }
+    pthread_rwlock_unlock(file_lock(path));
+}
 
-        // retreive parent path
-        char *parent_path = (char *) malloc((strlen(path)+1) * sizeof(char));
-        get_parent(path, parent_path);
+static size_t report_files = 0, report_fragmented = 0;
+static double report_total = 0;
+
+static void report_file(const char *path, off_t off, const struct sfs_entry *ent) {
+    (void)off;
+    size_t nblocks;
+    size_t runs = chain_runs(ent->first_block, &nblocks);
+    double score = frag_score(nblocks, runs);
+    printf("%8zu %6zu %6.3f  %s\n", nblocks, runs, score, path);
+    report_files++;
+    report_fragmented += runs > 1;
+    report_total += score;
+}
 
-        struct sfs_entry *parent_entry = (struct sfs_entry*) malloc(sizeof(struct sfs_entry));
-        unsigned int *parent_entry_off = (unsigned int*) malloc(sizeof(unsigned int));
-        blockidx_t *parent_blockidx = (blockidx_t *) malloc(sizeof(blockidx_t));
+/*
+Function that prints the blocks, runs and fragmentation score of every file,
+and a summary.
+*/
+static void frag_report(void) {
+    struct sfs_parent root = {SFS_BLOCKIDX_END, {{0}, 0, 0}, 0};
+    report_files = report_fragmented = 0;
+    report_total = 0;
+    printf("  blocks   runs  score  path\n");
+    walk_files("", &root, report_file);
+    printf("%zu files, %zu fragmented, mean score %.3f, %zu free blocks in %u-block runs at most\n",
+           report_files, report_fragmented, report_files > 0 ? report_total / report_files : 0,
+           free_blocks, extent_tree[1].best);
+}
 
-        int r = get_entry(parent_path, parent_entry, parent_entry_off, parent_blockidx);
-        if (r != 0) {return r;}
+static void defrag_all(void) {
+    struct sfs_parent root = {SFS_BLOCKIDX_END, {{0}, 0, 0}, 0};
+    walk_files("", &root, defrag_file);
+}
 
-        free(parent_blockidx); free(parent_entry_off); free(parent_path); // won't use those
+/*
+Function run by the background thread started by defrag_start: a pass over
+all files every options.defrag_interval seconds, until defrag_stop is called.
+*/
+static void *defrag_background(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&defrag_lock);
+    while (defrag_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += options.defrag_interval;
+        pthread_cond_timedwait(&defrag_cond, &defrag_lock, &ts);
+        if (!defrag_running) {break;}
+
+        pthread_mutex_unlock(&defrag_lock);
+        defrag_all();
+        pthread_mutex_lock(&defrag_lock);
+    }
+    pthread_mutex_unlock(&defrag_lock);
+    return NULL;
+}
 
-        // find empty entry in parent
-        struct sfs_entry *parent_dir = (struct sfs_entry*) malloc(SFS_DIR_SIZE);;
-        load_dir(parent_dir, parent_entry->first_block);
-        
-        struct sfs_entry *empty_ent;
-        for (size_t i = 0; i < SFS_DIR_NENTRIES; i++)
-        {
-            empty_ent = parent_dir + i;
-            if (strlen(empty_ent->filename) == 0) {
-                break;
-            }
-        }
+static void defrag_start(void) {
+    if (options.defrag_interval == 0) {return;}
 
-        strcpy(empty_ent->filename, newdir);
-        empty_ent->size = SFS_DIRECTORY;
-        empty_ent->first_block = block1;
+    defrag_running = 1;
+    if (pthread_create(&defrag_thread, NULL, defrag_background, NULL) != 0) {
+        perror("defrag: cannot start background thread");
+        defrag_running = 0;
+    }
+}
 
-        disk_write(parent_dir, SFS_DIR_SIZE, SFS_DATA_OFF + parent_entry->first_block * SFS_BLOCK_SIZE);        
+static void defrag_stop(void) {
+    if (!defrag_running) {return;}
 
-        free(parent_entry);
-    }     
+    pthread_mutex_lock(&defrag_lock);
+    defrag_running = 0;
+    pthread_cond_signal(&defrag_cond);
+    pthread_mutex_unlock(&defrag_lock);
+    pthread_join(defrag_thread, NULL);
+}
 
-    free(blocktable);
-    return 0;
+/*
+ * Called once when the filesystem is mounted, before any other callback.
+ */
+static void *sfs_init(struct fuse_conn_info *conn)
+{
+    (void)conn;
+    log("init\n");
+
+    locks_init();
+    scan_init();
+    if (options.mmap) {
+        img_mmap(options.img);
+    } else if (options.uring) {
+        img_uring(options.img);
+    }
+    cache_start();
+    blocktbl_load();
+    count_entries(SFS_BLOCKIDX_END);
+    defrag_start();
+    stats_start();
+    trace_start(options.trace);
+    return NULL;
 }
 
 
 /*
- * Remove directory at `path`.
- * Directories may only be removed if they are empty, otherwise this function
- * should return -ENOTEMPTY.
- * Returns 0 on success, < 0 on error.
+ * Called once when the filesystem is unmounted.
  */
-static int sfs_rmdir(const char *path)
+static void sfs_destroy(void *private_data)
 {
-    log("rmdir %s\n", path);
-    struct sfs_entry *ret_entry = (struct sfs_entry *) malloc(sizeof(struct sfs_entry));
-    unsigned int *ret_entry_off = (unsigned int *) malloc(sizeof(off_t));
-    blockidx_t *parent_blockidx = (blockidx_t *) malloc(sizeof(blockidx_t));
-
-    int r = get_entry(path, ret_entry, ret_entry_off, parent_blockidx);
-    if (r != 0) {return r;}
+    (void)private_data;
+    log("destroy\n");
+
+    trace_stop();
+    defrag_stop();
+    unwritten_materialize();
+    blocktbl_flush();
+    cache_stop();
+    img_flush();
+    dir_index_drop_all();
+    stats_stop();
+}
 
-    // Load the directory into memory
-    struct sfs_entry *dir = (struct sfs_entry *) malloc(SFS_DIR_SIZE);
-    load_dir(dir, ret_entry->first_block);
 
-    // check if directory is empty
-    for (size_t i = 0; i < SFS_DIR_NENTRIES; i++)
-    {
-        struct sfs_entry *ent = dir + i;
-        if (strlen(ent->filename) != 0) {
-            return -ENOTEMPTY;
-        }
-    }
+static const struct fuse_operations sfs_oper = {
+    .init       = sfs_init,
+    .destroy    = sfs_destroy,
+    .getattr    = sfs_getattr,
+    .statfs     = sfs_statfs,
+    .readdir    = sfs_readdir,
+    .open       = sfs_open,
+    .release    = sfs_release,
+    .flush      = sfs_flush,
+    .fsync      = sfs_fsync,
+    .read       = sfs_read,
+    .mkdir      = sfs_mkdir,
+    .rmdir      = sfs_rmdir,
+    .unlink     = sfs_unlink,
+    .create     = sfs_create,
+    .truncate   = sfs_truncate,
+    .ftruncate  = sfs_ftruncate,
+    .fallocate  = sfs_fallocate,
+    .write      = sfs_write,
+    .rename     = sfs_rename,
+};
 
-    // free the blocks
-    blockidx_t freeblock = SFS_BLOCKIDX_EMPTY;
-    blockidx_t block2;
-    disk_read(&block2, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + ret_entry->first_block * sizeof(blockidx_t));
-    disk_write(&freeblock, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + ret_entry->first_block * sizeof(blockidx_t));
-    disk_write(&freeblock, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + block2 * sizeof(blockidx_t));
 
-    // remove entry from parents
-    strcpy(ret_entry->filename, "");
-    ret_entry->size = 0;
-    ret_entry->first_block = freeblock;
+/*
+ * Low-level API (--lowlevel). Instead of paths, the kernel hands us inode
+ * numbers, which are derived from the location of the entry on disk: the
+ * slot at byte offset off has inode (off - SFS_ROOTDIR_OFF) / 64 + 2 (the
+ * root directory itself is FUSE_ROOT_ID). lookup resolves one name in one
+ * directory, and every other callback goes straight to the slot of its inode,
+ * so deep paths are not walked again on every operation. Files are locked by
+ * inode instead of by path, and handles have no path, so they are refreshed
+ * from the slot.
+ */
+/*
+Function that reads the entry of inode ino (which must not be the root).
+Returns 0 on success, or -ENOENT if the inode is not a slot in use.
+*/
+static int ino_entry(fuse_ino_t ino, struct sfs_entry *ent) {
+    if (ino < 2) {return -ENOENT;}
+    off_t off = ino_slot(ino);
+    int in_rootdir = off < (off_t) (SFS_ROOTDIR_OFF + SFS_ROOTDIR_SIZE);
+    int in_data = off >= (off_t) SFS_DATA_OFF
+        && off < (off_t) (SFS_DATA_OFF + SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE);
+    if (!in_rootdir && !in_data) {return -ENOENT;}
+
+    img_read(ent, sizeof(struct sfs_entry), off);
+    if (strlen(ent->filename) == 0) {return -ENOENT;}
+    return 0;
+}
 
-    // write to disk
-    if (in_root(path) == 1) {
-        disk_write(ret_entry, sizeof(struct sfs_entry), SFS_ROOTDIR_OFF + *ret_entry_off * sizeof(struct sfs_entry));
-    } else {
-        disk_write(ret_entry, sizeof(struct sfs_entry), SFS_DATA_OFF + *parent_blockidx * SFS_BLOCK_SIZE + *ret_entry_off * sizeof(struct sfs_entry));
+/*
+Function that resolves the directory with inode ino, like get_parent_dir does
+for a path. Returns 0 on success, -ENOENT or -ENOTDIR.
+*/
+static int ino_parent(fuse_ino_t ino, struct sfs_parent *p) {
+    if (ino == FUSE_ROOT_ID) {
+        p->dir = SFS_BLOCKIDX_END;
+        return 0;
     }
-
-
-    free(ret_entry); free(ret_entry_off); free(parent_blockidx); free(dir);
+    int r = ino_entry(ino, &p->entry);
+    if (r != 0) {return r;}
+    if (!(p->entry.size & SFS_DIRECTORY)) {return -ENOTDIR;}
+    p->dir = p->entry.first_block;
+    p->entry_off = ino_slot(ino);
     return 0;
 }
 
-
 /*
- * Remove file at `path`.
- * Can not be used to remove directories.
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_unlink(const char *path)
+Function that looks up `name` in the directory p. Returns 0 and the entry and
+its offset on disk, or -ENOENT.
+*/
+static int ino_find(const struct sfs_parent *p, const char *name, struct sfs_entry *ret_entry,
+                    off_t *ret_off)
 {
-    log("unlink %s\n", path);
-
-    // Get entry of file
-    struct sfs_entry *ret_entry = (struct sfs_entry *) malloc(sizeof(struct sfs_entry));
-    unsigned int *ret_entry_off = (unsigned int *) malloc(sizeof(off_t));
-    blockidx_t *parent_blockidx = (blockidx_t *) malloc(sizeof(blockidx_t));
-
-    int r = get_entry(path, ret_entry, ret_entry_off, parent_blockidx);
+    int r = dir_lock_parent(p, 0);
     if (r != 0) {return r;}
 
-    blockidx_t freeblock = SFS_BLOCKIDX_EMPTY;
-
-    // remove entries from blocktable
-
-    blockidx_t curr = ret_entry->first_block;
-    blockidx_t next;
-    while (curr != SFS_BLOCKIDX_END) {
-        disk_read(&next, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + curr * sizeof(blockidx_t));
-        disk_write(&freeblock, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + curr * sizeof(blockidx_t));
-        curr = next;
-    }
-
-    // remove entry from parent
-    strcpy(ret_entry->filename, "");
-    ret_entry->size = 0;
-    ret_entry->first_block = freeblock;
+    *ret_off = dir_find(p->dir, name, ret_entry);
+    pthread_rwlock_unlock(dir_lock(p->dir));
+    return *ret_off < 0 ? -ENOENT : 0;
+}
 
-    // write it to disk
-    if (in_root(path) == 1) {
-        disk_write(ret_entry, sizeof(struct sfs_entry), SFS_ROOTDIR_OFF + *ret_entry_off * sizeof(struct sfs_entry));
+static void ll_reply_entry(fuse_req_t req, const struct sfs_entry *ent, off_t off,
+                           struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = slot_ino(off);
+    e.generation = slot_gen(off);
+    e.attr_timeout = 1.0;
+    e.entry_timeout = 1.0;
+    entry_stat(ent, &e.attr);
+    e.attr.st_ino = e.ino;
+    if (fi != NULL) {
+        fuse_reply_create(req, &e, fi);
     } else {
-        disk_write(ret_entry, sizeof(struct sfs_entry), SFS_DATA_OFF + *parent_blockidx * SFS_BLOCK_SIZE + *ret_entry_off * sizeof(struct sfs_entry));
+        fuse_reply_entry(req, &e);
     }
+}
 
-    free(ret_entry); free(ret_entry_off); free(parent_blockidx);
+static void sfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void)userdata;
+    sfs_init(conn);
+}
 
-    return 0;
+static void sfs_ll_destroy(void *userdata)
+{
+    sfs_destroy(userdata);
 }
 
+static void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    log("lookup %lu %s\n", (unsigned long) parent, name);
+    STATS_TIME(STATS_LOOKUP);
+
+    if (stats_name(parent, name)) {
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = STATS_INO;
+        stats_stat(&e.attr);
+        e.attr.st_ino = e.ino;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    struct sfs_parent p;
+    struct sfs_entry ent;
+    off_t off;
+    int r = ino_parent(parent, &p);
+    if (r == 0) {r = ino_find(&p, name, &ent, &off);}
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    ll_reply_entry(req, &ent, off, NULL);
+}
 
-/*
- * Create an empty file at `path`.
- * The `mode` argument describes the permissions, which you may ignore for this
- * assignment.
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_create(const char *path,
-                      mode_t mode,
-                      struct fuse_file_info *fi)
+static void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
 {
-    (void)fi;
-    log("create %s mode=%o\n", path, mode);
+    // inodes are slots on disk, there is nothing to drop
+    (void)ino; (void)nlookup;
+    STATS_TIME(STATS_FORGET);
+    fuse_reply_none(req);
+}
 
-    // Get the filename
-    char *newdir;
-    get_child(path, &newdir);
-    if (strlen(newdir) >= 58) {return -ENAMETOOLONG;}
+static void sfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    log("statfs %lu\n", (unsigned long) ino);
+    STATS_TIME(STATS_STATFS);
 
-    // create a new entry for a file
-    struct sfs_entry newfile;
-    strcpy(newfile.filename, newdir);
-    newfile.size = 0;
-    newfile.first_block = SFS_BLOCKIDX_END;
+    struct statvfs st;
+    fill_statfs(&st);
+    fuse_reply_statfs(req, &st);
+}
 
-    // find empty entry and write
-    if (in_root(path) == 1) {
-        // in rootdir
-        struct sfs_entry *rootdir = (struct sfs_entry *) malloc(SFS_ROOTDIR_SIZE);
-        disk_read(rootdir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+static void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void)fi;
+    log("getattr %lu\n", (unsigned long) ino);
+    STATS_TIME(STATS_GETATTR);
+
+    struct stat st;
+    if (ino == FUSE_ROOT_ID) {
+        entry_stat(NULL, &st);
+    } else if (ino == STATS_INO) {
+        stats_stat(&st);
+    } else {
+        struct sfs_entry ent;
+        int r = ino_entry(ino, &ent);
+        if (r != 0) {
+            fuse_reply_err(req, -r);
+            return;
+        }
+        entry_stat(&ent, &st);
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, 1.0);
+}
 
-        struct sfs_entry *empty_ent;
-        for (size_t i = 0; i < SFS_ROOTDIR_NENTRIES; i++)
-        {
-            if (strlen(rootdir[i].filename) == 0) {
-                empty_ent = rootdir + i;
+/*
+ * Only changes of the size (truncate) are supported; other attributes are
+ * ignored, as they are with the path API.
+ */
+static void sfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                           struct fuse_file_info *fi)
+{
+    log("setattr %lu to_set=%x\n", (unsigned long) ino, to_set);
+    STATS_TIME(STATS_SETATTR);
+
+    int r = 0;
+    if (ino == STATS_INO) {
+        // the statistics have no size to set, and fi holds no handle
+        if (to_set & FUSE_SET_ATTR_SIZE) {r = -EPERM;}
+    } else if (to_set & FUSE_SET_ATTR_SIZE) {
+        pthread_rwlock_wrlock(ino_lock(ino));
+        struct sfs_handle *h = get_handle(fi);
+        if (h != NULL) {
+            r = truncate_entry(NULL, h->dir, &h->entry, h->entry_off, attr->st_size);
+        } else {
+            struct sfs_entry ent;
+            r = ino_entry(ino, &ent);
+            if (r == 0 && (ent.size & SFS_DIRECTORY)) {r = -EISDIR;}
+            if (r == 0) {
+                r = truncate_entry(NULL, slot_dir(ino_slot(ino)), &ent, ino_slot(ino), attr->st_size);
             }
         }
-        if (!empty_ent) {return -1;} // no more entries
-
-        *empty_ent = newfile;
-
-        disk_write(rootdir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-        free(rootdir);
-        
-    } else {
-        // find it in subdir
-
-        // get parent path
-        char *parent_path = (char *) malloc((strlen(path)+1) * sizeof(char));
-        get_parent(path, parent_path);
-
-        struct sfs_entry *parent_entry = (struct sfs_entry *) malloc(sizeof(struct sfs_entry));
-        unsigned int *parent_entry_off = (unsigned int *) malloc(sizeof(off_t));
-        blockidx_t *parent_blockidx = (blockidx_t *) malloc(sizeof(blockidx_t));
-
-        int r = get_entry(parent_path, parent_entry, parent_entry_off, parent_blockidx);
-        if (r != 0) {return r;}
-
-        free(parent_path);
+        pthread_rwlock_unlock(ino_lock(ino));
+    }
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    sfs_ll_getattr(req, ino, fi);
+}
 
-        free(parent_entry_off); free(parent_blockidx); // won't use those
+static void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info *fi)
+{
+    (void)fi;
+    log("readdir %lu size=%zu off=%ld\n", (unsigned long) ino, size, off);
+    STATS_TIME(STATS_READDIR);
+
+    struct sfs_parent p;
+    int r = ino_parent(ino, &p);
+    if (r == 0) {r = dir_lock_parent(&p, 0);}
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
 
-        // load parent dir
-        struct sfs_entry *parent_dir = (struct sfs_entry *) malloc(SFS_DIR_SIZE);
-        load_dir(parent_dir, parent_entry->first_block);
-        
-        struct sfs_entry *empty_ent;
-        for (size_t i = 0; i < SFS_DIR_NENTRIES; i++)
-        {
-            if (strlen(parent_dir[i].filename) == 0) {
-                empty_ent = parent_dir + i;
-            }
-        }
+    // the offset of an entry is its slot + 1, so a later call continues there
+    struct sfs_entry entbuf[SFS_ROOTDIR_NENTRIES];
+    size_t nentries;
+    struct sfs_entry *dir = read_dir(p.dir, entbuf, &nentries);
+    SCRATCH_SCOPE();
+    char *buf = (char *) scratch_alloc(size);
+    size_t used = 0;
+    for (size_t i = off; i < nentries; i++) {
+        if (dir[i].filename[0] == '\0') {continue;}
+
+        struct stat st;
+        entry_stat(&dir[i], &st);
+        st.st_ino = slot_ino(dir_slot_off(p.dir, i));
+        size_t len = fuse_add_direntry(req, buf + used, size - used, dir[i].filename, &st, i + 1);
+        if (len > size - used) {break;}
+        used += len;
+    }
+    pthread_rwlock_unlock(dir_lock(p.dir));
 
-        if (!empty_ent) {return -1;} // no more entries
+    fuse_reply_buf(req, buf, used);
+}
 
-        *empty_ent = newfile;
+static void sfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    log("open %lu\n", (unsigned long) ino);
+    STATS_TIME(STATS_OPEN);
 
-        disk_write(parent_dir, SFS_DIR_SIZE, SFS_DATA_OFF + parent_entry->first_block * SFS_BLOCK_SIZE);
-        free(parent_dir); free(parent_entry);
+    int r;
+    if (ino == STATS_INO) {
+        r = stats_open(fi);
+    } else {
+        pthread_rwlock_rdlock(ino_lock(ino));
+        struct sfs_entry ent;
+        r = ino_entry(ino, &ent);
+        if (r == 0) {r = handle_open(NULL, ino_slot(ino), fi);}
+        pthread_rwlock_unlock(ino_lock(ino));
     }
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    fuse_reply_open(req, fi);
+}
 
+static void sfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    log("release %lu\n", (unsigned long) ino);
+    STATS_TIME(STATS_RELEASE);
 
-    return 0;
+    if (ino == STATS_INO) {
+        stats_close(fi);
+        fuse_reply_err(req, 0);
+        return;
+    }
+    handle_close(fi);
+    cache_flush();
+    fuse_reply_err(req, 0);
 }
 
-
-/*
- * Shrink or grow the file at `path` to `size` bytes.
- * Excess bytes are thrown away, whereas any bytes added in the process should
- * be nil (\0).
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_truncate(const char *path, off_t size)
+static void sfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    log("truncate %s size=%ld\n", path, size);
+    (void)fi;
+    log("flush %lu\n", (unsigned long) ino);
+    STATS_TIME(STATS_FLUSH);
 
-    // getting the entry
-    struct sfs_entry *ret_entry = (struct sfs_entry *) malloc(sizeof(struct sfs_entry));
-    unsigned int *ret_entry_off = (unsigned int *) malloc(sizeof(off_t));
-    blockidx_t *parent_blockidx = (blockidx_t *) malloc(sizeof(blockidx_t));
-    int r = get_entry(path, ret_entry, ret_entry_off, parent_blockidx);
-    if (r != 0){return r;}
+    cache_flush();
+    fuse_reply_err(req, 0);
+}
 
+static void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    (void)datasync; (void)fi;
+    log("fsync %lu\n", (unsigned long) ino);
+    STATS_TIME(STATS_FSYNC);
 
+    img_flush();
+    fuse_reply_err(req, 0);
+}
 
-    unsigned int curr_block_amnt = (ret_entry->size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
-    unsigned int block_amnt_need = (size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
-    if (block_amnt_need < curr_block_amnt) {
-        // SHRINKING
+static void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                        struct fuse_file_info *fi)
+{
+    log("read %lu size=%zu offset=%ld\n", (unsigned long) ino, size, off);
+    STATS_TIME(STATS_READ);
+
+    SCRATCH_SCOPE();
+    char *buf = (char *) scratch_alloc(size);
+    int r;
+    if (ino == STATS_INO) {
+        r = stats_read(fi, buf, size, off);
+    } else {
+        pthread_rwlock_rdlock(ino_lock(ino));
+        r = read_locked(NULL, buf, size, off, fi);
+        pthread_rwlock_unlock(ino_lock(ino));
+    }
+    if (r < 0) {
+        fuse_reply_err(req, -r);
+    } else {
+        fuse_reply_buf(req, buf, r);
+    }
+}
 
-        // getting all the blockidx in an array
-        blockidx_t *blocks = (blockidx_t *) malloc(curr_block_amnt*sizeof(blockidx_t));
-        blocks[0] = ret_entry->first_block;
-        for (size_t i = 1; i < curr_block_amnt; i++)
-        {
-            disk_read(blocks + i, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + blocks[i-1] * sizeof(blockidx_t));
-        }
+static void sfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                         off_t off, struct fuse_file_info *fi)
+{
+    log("write %lu size=%zu offset=%ld\n", (unsigned long) ino, size, off);
+    STATS_TIME(STATS_WRITE);
+
+    int r = 0;
+    if (size > 0) {
+        pthread_rwlock_wrlock(ino_lock(ino));
+        r = write_locked(NULL, buf, size, off, fi);
+        pthread_rwlock_unlock(ino_lock(ino));
+    }
+    if (r < 0) {
+        fuse_reply_err(req, -r);
+    } else {
+        fuse_reply_write(req, r);
+    }
+}
 
-        // removing the right amount of blocks starting from the back
-        int blocks_torem = curr_block_amnt - block_amnt_need;
-        blockidx_t empty = SFS_BLOCKIDX_EMPTY;
-        for (int i = 0; i < blocks_torem; i++)
-        {
-            disk_write(&empty, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + blocks[curr_block_amnt - (1 + i)] * sizeof(blockidx_t));
-        }
-        
-        // write EOF on last used block
-        if (size != 0) {
-            blockidx_t eof = SFS_BLOCKIDX_END;
-            disk_write(&eof, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + blocks[curr_block_amnt - (1 + blocks_torem)] * sizeof(blockidx_t));
+static void sfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                             struct fuse_file_info *fi)
+{
+    log("fallocate %lu mode=%x offset=%ld length=%ld\n", (unsigned long) ino, mode, offset, length);
+    STATS_TIME(STATS_FALLOCATE);
+
+    int r = 0;
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        r = -EOPNOTSUPP;
+    } else if (offset < 0 || length <= 0) {
+        r = -EINVAL;
+    } else {
+        pthread_rwlock_wrlock(ino_lock(ino));
+        struct sfs_handle *h = get_handle(fi);
+        if (h != NULL) {
+            r = fallocate_entry(NULL, h->dir, &h->entry, h->entry_off, mode, offset + length);
         } else {
-            ret_entry->first_block = SFS_BLOCKIDX_END;
+            struct sfs_entry ent;
+            r = ino_entry(ino, &ent);
+            if (r == 0) {
+                r = fallocate_entry(NULL, slot_dir(ino_slot(ino)), &ent, ino_slot(ino), mode,
+                                    offset + length);
+            }
         }
+        pthread_rwlock_unlock(ino_lock(ino));
+    }
+    fuse_reply_err(req, -r);
+}
 
-        free(blocks);
+static void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                          struct fuse_file_info *fi)
+{
+    log("create %lu %s mode=%o\n", (unsigned long) parent, name, mode);
+    STATS_TIME(STATS_CREATE);
 
-    } else if (block_amnt_need > curr_block_amnt) {
-        // GROWING
+    if (strlen(name) >= SFS_FILENAME_MAX) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+    if (stats_name(parent, name)) {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
 
-        // loading up blocktable
-        blockidx_t *blocktable = (blockidx_t *) malloc(SFS_BLOCKTBL_SIZE);
-        disk_read(blocktable, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+    struct sfs_entry newfile;
+    memset(&newfile, 0, sizeof(newfile));
+    strcpy(newfile.filename, name);
+    newfile.size = 0;
+    newfile.first_block = SFS_BLOCKIDX_END;
 
-        // finding right amount of free blocks
-        int blocks_to_add = block_amnt_need - curr_block_amnt;
-        blockidx_t newblocks[blocks_to_add];
-        
-        int found = 0;
-        for (size_t i = 0; i < SFS_BLOCKTBL_NENTRIES; i++)
-        {
-            if (blocktable[i] == SFS_BLOCKIDX_EMPTY) {
-                newblocks[found] = i;
-                found++;
-                if (found == blocks_to_add) {break;}
-            }
-        }
+    struct sfs_parent p;
+    off_t off;
+    int r = ino_parent(parent, &p);
+    if (r == 0) {r = dir_lock_parent(&p, 1);}
+    if (r == 0) {
+        r = dir_add(NULL, &p, &newfile, &off);
+        pthread_rwlock_unlock(dir_lock(p.dir));
+    }
+    if (r == 0) {
+        pthread_rwlock_rdlock(ino_lock(slot_ino(off)));
+        r = handle_open(NULL, off, fi);
+        pthread_rwlock_unlock(ino_lock(slot_ino(off)));
+    }
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    ll_reply_entry(req, &newfile, off, fi);
+}
 
-        // find last blockidx
-        if (ret_entry->first_block != SFS_BLOCKIDX_END) {
-            blockidx_t lastblock = ret_entry->first_block;
-            blockidx_t next = blocktable[lastblock];
-            while (next != SFS_BLOCKIDX_END) {
-                lastblock = next;
-                next = blocktable[lastblock];
-            }
-            blocktable[lastblock] = newblocks[0];
-        } else {
-            ret_entry->first_block = newblocks[0];
-        }
-        
-        // setting right values for those blocks in table
-        for (int i = 0; i < blocks_to_add - 1; i++)
-        {
-            blocktable[newblocks[i]] = newblocks[i+1];
-        }
-        blocktable[newblocks[blocks_to_add - 1]] = SFS_BLOCKIDX_END;
+static void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    log("mkdir %lu %s mode=%o\n", (unsigned long) parent, name, mode);
+    STATS_TIME(STATS_MKDIR);
 
-        // write back blocktable
-        disk_write(blocktable, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
-        
-        free(blocktable);
+    if (strlen(name) >= SFS_FILENAME_MAX) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+    if (stats_name(parent, name)) {
+        fuse_reply_err(req, EEXIST);
+        return;
     }
 
-    // change size in entry
-    ret_entry->size = size;
+    struct sfs_parent p;
+    struct sfs_entry ent;
+    off_t off;
+    int r = ino_parent(parent, &p);
+    if (r == 0) {r = make_dir(NULL, &p, name, &off);}
+    if (r == 0) {r = ino_entry(slot_ino(off), &ent);}
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    ll_reply_entry(req, &ent, off, NULL);
+}
 
+/*
+Function that removes `name` from the directory with inode parent, as a file
+or (with `dir` set) as a directory. The file lock of the inode is taken first,
+and the name looked up again under it, in case it changed meanwhile.
+*/
+static int ll_remove(fuse_ino_t parent, const char *name, int dir)
+{
+    if (stats_name(parent, name)) {return dir ? -ENOTDIR : -EPERM;}
+    struct sfs_parent p;
+    struct sfs_entry ent;
+    off_t off;
+    int r = ino_parent(parent, &p);
+    if (r == 0) {r = ino_find(&p, name, &ent, &off);}
+    if (r != 0) {return r;}
 
-    // write the new entry for the file
-    if (in_root(path) == 1) {
-        disk_write(ret_entry, sizeof(struct sfs_entry), SFS_ROOTDIR_OFF + *ret_entry_off * sizeof(struct sfs_entry));
-    } else {
-        disk_write(ret_entry, sizeof(struct sfs_entry), SFS_DATA_OFF + *parent_blockidx * SFS_BLOCK_SIZE + *ret_entry_off * sizeof(struct sfs_entry));
+    fuse_ino_t ino = slot_ino(off);
+    pthread_rwlock_wrlock(ino_lock(ino));
+    off_t now;
+    r = ino_find(&p, name, &ent, &now);
+    if (r == 0 && now != off) {r = -EAGAIN;}
+    if (r == 0) {
+        r = dir ? remove_dir(NULL, p.dir, ent, off) : remove_file(NULL, p.dir, ent, off);
     }
-    free(parent_blockidx);
-    free(ret_entry_off); 
-    free(ret_entry);
-    return 0;
+    pthread_rwlock_unlock(ino_lock(ino));
+    return r == -EAGAIN ? ll_remove(parent, name, dir) : r;
 }
 
+static void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    log("unlink %lu %s\n", (unsigned long) parent, name);
+    STATS_TIME(STATS_UNLINK);
+    fuse_reply_err(req, -ll_remove(parent, name, 0));
+}
+
+static void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    log("rmdir %lu %s\n", (unsigned long) parent, name);
+    STATS_TIME(STATS_RMDIR);
+    fuse_reply_err(req, -ll_remove(parent, name, 1));
+}
 
 /*
- * Write contents of `buf` (of `size` bytes) to the file at `path`.
- * The file is grown if nessecary, and any bytes already present are overwritten
- * (whereas any other data is left intact). The `offset` argument specifies how
- * many bytes should be skipped in the file, after which `size` bytes from
- * buffer are written.
- * This means that the new file size will be max(old_size, offset + size).
- * Returns the number of bytes written, or < 0 on error.
- */
-static int sfs_write(const char *path,
-                     const char *buf,
-                     size_t size,
-                     off_t offset,
-                     struct fuse_file_info *fi)
+Function that renames `name` to `newname` in directory `parent`, like
+rename_locked does for paths. The inodes of both entries are looked up first
+and locked, and if either entry moved in the meantime this starts over.
+*/
+static int ll_rename(fuse_ino_t parent, const char *name, const char *newname)
 {
-    (void)fi;
-    log("write %s data='%.*s' size=%zu offset=%ld\n", path, (int)size, buf,
-        size, offset);
+    struct sfs_parent p;
+    struct sfs_entry src, tgt;
+    off_t src_off, tgt_off;
+    int r = ino_parent(parent, &p);
+    if (r == 0) {r = ino_find(&p, name, &src, &src_off);}
+    if (r != 0) {return r;}
+    if (ino_find(&p, newname, &tgt, &tgt_off) != 0) {tgt_off = -1;}
+
+    pthread_rwlock_t *a = ino_lock(slot_ino(src_off));
+    pthread_rwlock_t *b = tgt_off >= 0 ? ino_lock(slot_ino(tgt_off)) : a;
+    if (a > b) {
+        pthread_rwlock_t *t = a;
+        a = b;
+        b = t;
+    }
+    pthread_mutex_lock(&rename_lock);
+    pthread_rwlock_wrlock(a);
+    if (b != a) {pthread_rwlock_wrlock(b);}
+
+    blockidx_t dirs[2] = {p.dir, SFS_BLOCKIDX_EMPTY};
+    size_t ndirs = tgt_off >= 0 && (tgt.size & SFS_DIRECTORY) ? 2 : 1;
+    if (ndirs == 2) {dirs[1] = tgt.first_block;}
+    dir_lock_all(dirs, ndirs);
+    r = dir_check_parent(&p);
+    if (r == 0) {
+        struct sfs_entry now_src, now_tgt;
+        if (dir_find(p.dir, name, &now_src) != src_off || dir_find(p.dir, newname, &now_tgt) != tgt_off) {
+            r = -EAGAIN;
+        } else {
+            r = move_entry(NULL, NULL, p.dir, now_src, src_off, &p, newname, now_tgt, tgt_off);
+        }
+    }
+    dir_unlock_all(dirs, ndirs);
 
-    return -ENOSYS;
+    if (b != a) {pthread_rwlock_unlock(b);}
+    pthread_rwlock_unlock(a);
+    pthread_mutex_unlock(&rename_lock);
+    return r == -EAGAIN ? ll_rename(parent, name, newname) : r;
 }
 
-
 /*
- * Move/rename the file at `path` to `newpath`.
- * Returns 0 on succes, < 0 on error.
+ * Renames keep the entry in its slot, and so keep its inode, which the kernel
+ * relies on. Moving an entry to another directory would give it a new slot,
+ * so such renames fail with EXDEV (and mv copies the file instead).
  */
-static int sfs_rename(const char *path,
-                      const char *newpath)
+static void sfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          fuse_ino_t newparent, const char *newname)
 {
-    /* Implementing this function is optional, and not worth any points. */
-    log("rename %s %s\n", path, newpath);
-
-    return -ENOSYS;
+    log("rename %lu %s %lu %s\n", (unsigned long) parent, name, (unsigned long) newparent, newname);
+    STATS_TIME(STATS_RENAME);
+
+    if (strlen(newname) >= SFS_FILENAME_MAX) {
+        fuse_reply_err(req, ENAMETOOLONG);
+    } else if (stats_name(parent, name) || stats_name(newparent, newname)) {
+        fuse_reply_err(req, EACCES);
+    } else if (newparent != parent) {
+        fuse_reply_err(req, EXDEV);
+    } else if (strcmp(name, newname) == 0) {
+        fuse_reply_err(req, 0);
+    } else {
+        fuse_reply_err(req, -ll_rename(parent, name, newname));
+    }
 }
 
 
-static const struct fuse_operations sfs_oper = {
-    .getattr    = sfs_getattr,
-    .readdir    = sfs_readdir,
-    .read       = sfs_read,
-    .mkdir      = sfs_mkdir,
-    .rmdir      = sfs_rmdir,
-    .unlink     = sfs_unlink,
-    .create     = sfs_create,
-    .truncate   = sfs_truncate,
-    .write      = sfs_write,
-    .rename     = sfs_rename,
+static const struct fuse_lowlevel_ops sfs_ll_oper = {
+    .init       = sfs_ll_init,
+    .destroy    = sfs_ll_destroy,
+    .lookup     = sfs_ll_lookup,
+    .forget     = sfs_ll_forget,
+    .getattr    = sfs_ll_getattr,
+    .statfs     = sfs_ll_statfs,
+    .setattr    = sfs_ll_setattr,
+    .readdir    = sfs_ll_readdir,
+    .open       = sfs_ll_open,
+    .release    = sfs_ll_release,
+    .flush      = sfs_ll_flush,
+    .fsync      = sfs_ll_fsync,
+    .read       = sfs_ll_read,
+    .write      = sfs_ll_write,
+    .fallocate  = sfs_ll_fallocate,
+    .create     = sfs_ll_create,
+    .mkdir      = sfs_ll_mkdir,
+    .unlink     = sfs_ll_unlink,
+    .rmdir      = sfs_ll_rmdir,
+    .rename     = sfs_ll_rename,
 };
 
+/*
+Function that mounts the image with the low-level API and serves requests
+until it is unmounted, like fuse_main does for the path API.
+*/
+static int sfs_ll_main(struct fuse_args *args)
+{
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) != 0) {return 1;}
+
+    struct fuse_chan *ch = fuse_mount(mountpoint, args);
+    if (ch != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(args, &sfs_ll_oper, sizeof(sfs_ll_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+    return err ? 1 : 0;
+}
+
 
 #define OPTION(t, p)                            \
     { t, offsetof(struct options, p), 1 }
@@ -863,6 +5028,16 @@ static const struct fuse_opt option_spec[] = {
     LOPTION("-v",       "--verbose",    verbose),
     LOPTION("-h",       "--help",       show_help),
     OPTION(             "--fuse-help",  show_fuse_help),
+    OPTION(             "--mmap",       mmap),
+    OPTION(             "--uring",      uring),
+    OPTION(             "--lowlevel",   lowlevel),
+    OPTION(             "--cache=%u",   cache),
+    OPTION(             "--writeback=%u", writeback),
+    OPTION(             "--readahead=%u", readahead),
+    OPTION(             "--defrag",     defrag),
+    OPTION(             "--frag-report", frag_report),
+    OPTION(             "--defrag-interval=%u", defrag_interval),
+    OPTION(             "--trace=%s",   trace),
     FUSE_OPT_END
 };
 
@@ -880,6 +5055,23 @@ static void show_help(const char *progname)
            "    -v, --verbose       print debug information\n"
            "    -h, --help          show this summarized help\n"
            "        --fuse-help     show full FUSE help\n"
+           "        --mmap          access the image through a memory mapping\n"
+           "        --uring         submit batched image I/O through io_uring\n"
+           "        --lowlevel      use the inode-based low-level FUSE API\n"
+           "        --cache=N       cache N blocks of the image, writing them\n"
+           "                        back later (default: 0, no cache)\n"
+           "        --writeback=S   write the cache back every S seconds\n"
+           "                        (default: 5, 0 for only on flush/fsync)\n"
+           "        --readahead=K   read K blocks ahead on sequential reads\n"
+           "                        (default: 32, 0 to disable)\n"
+           "        --defrag-interval=S  defragment files in the background\n"
+           "                        every S seconds (default: 0, never)\n"
+           "        --defrag        defragment the image and exit\n"
+           "        --frag-report   print the fragmentation of every file\n"
+           "                        in the image and exit\n"
+           "        --trace=FILE    record every operation in FILE, to be\n"
+           "                        played back with replay (not with\n"
+           "                        --lowlevel)\n"
            "\n", default_img);
 }
 
@@ -888,6 +5080,8 @@ int main(int argc, char **argv)
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
     options.img = strdup(default_img);
+    options.writeback = 5;
+    options.readahead = 32;
 
     fuse_opt_parse(&args, &options, option_spec, NULL);
 
@@ -906,6 +5100,22 @@ int main(int argc, char **argv)
 
     disk_open_image(options.img);
 
+    if (options.frag_report || options.defrag) {
+        // offline: work on the image directly, without mounting it
+        sfs_init(NULL);
+        if (options.defrag) {defrag_all();}
+        if (options.frag_report) {frag_report();}
+        sfs_destroy(NULL);
+        return 0;
+    }
+
+    if (options.lowlevel) {
+        if (options.trace != NULL) {
+            fprintf(stderr, "--trace needs the path API, not --lowlevel\n");
+            return 1;
+        }
+        return sfs_ll_main(&args);
+    }
     return fuse_main(args.argc, args.argv, &sfs_oper, NULL);
 }
 